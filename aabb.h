@@ -7,7 +7,8 @@ class AABB {
 
 public:
     AABB() {};
-    AABB(const point3& minima, const point3& maxima) : m_boxMin(minima), m_boxMax(maxima) { padToMin(); }
+    // The two points can be any opposite corners, they get sorted per axis
+    AABB(const point3& a, const point3& b) : m_boxMin(min(a, b)), m_boxMax(max(a, b)) { padToMin(); }
     AABB(const Interval& x, const Interval& y, const Interval& z) {
         m_boxMin = point3(x.min, y.min, z.min);
         m_boxMax = point3(x.max, y.max, z.max);
@@ -19,6 +20,17 @@ public:
         padToMin();
     }
 
+    point3 centroid() const {
+        return (m_boxMin + m_boxMax) * 0.5;
+    }
+
+    double surfaceArea() const {
+        if (m_boxMax[0] < m_boxMin[0])
+            return 0;
+        vec3 d = m_boxMax - m_boxMin;
+        return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
     int longestAxis() const {
         vec3 span = m_boxMax - m_boxMin;
         if (span[0] > span[1]) 
@@ -27,7 +39,7 @@ public:
             return span[1] > span[2] ? 1 : 2;
     }
 
-    Interval axisBounds(int n) {
+    Interval axisBounds(int n) const {
         if (n == 1)
             return Interval(m_boxMin.y(), m_boxMax.y());
         else if (n == 2)
@@ -36,33 +48,20 @@ public:
     }
 
     bool hit(const Ray& r, Interval ray_t) const {
-        double tmin = numeric_limits<double>::lowest(), tmax = numeric_limits<double>::max();
-        vec3 ndir = (r.direction());           
-        vec3 dirfrac;
-        dirfrac[0] = 1.0f / ndir[0];
-        dirfrac[1] = 1.0f / ndir[1];
-        dirfrac[2] = 1.0f / ndir[2];
-
-        double t1 = (m_boxMin[0] - r.origin()[0])*dirfrac[0];
-        double t2 = (m_boxMax[0] - r.origin()[0])*dirfrac[0];
-        double t3 = (m_boxMin[1] - r.origin()[1])*dirfrac[1];
-        double t4 = (m_boxMax[1] - r.origin()[1])*dirfrac[1];
-        double t5 = (m_boxMin[2] - r.origin()[2])*dirfrac[2];
-        double t6 = (m_boxMax[2] - r.origin()[2])*dirfrac[2];
-
-        tmin = max(max(min(t1, t2), min(t3, t4)), min(t5, t6));
-        tmax = min(min(max(t1, t2), max(t3, t4)), max(t5, t6));
-
-        // if tmax < 0, ray (line) is intersecting AABB, but the whole AABB is behind us
-        if (tmax < 0)
-        {
-            return false;
-        }
-
-        // if tmin > tmax, ray doesn't intersect AABB
-        if (tmin > tmax)
-        {
-            return false;
+        const point3& orig = r.origin();
+        const vec3& invDir = r.inv_direction();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            double t0 = (m_boxMin[axis] - orig[axis]) * invDir[axis];
+            double t1 = (m_boxMax[axis] - orig[axis]) * invDir[axis];
+            if (invDir[axis] < 0)
+                std::swap(t0, t1);
+
+            // Written so a NaN slab (ray parallel to and inside a face) leaves the interval alone
+            ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+            ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+            if (ray_t.max < ray_t.min)
+                return false;
         }
 
         return true;
@@ -74,16 +73,16 @@ protected:
     void padToMin() {
         static const double MIN_SIZE = 0.0001;
 
-        //Sigh
-        point3 center = (m_boxMax + m_boxMin) * 0.5;
-        vec3 bounds = (m_boxMax - m_boxMin);
-        bounds[0] = max(MIN_SIZE, bounds[0]);
-        bounds[1] = max(MIN_SIZE, bounds[1]);
-        bounds[2] = max(MIN_SIZE, bounds[2]);
-        bounds *= 0.5;
+        for (int axis = 0; axis < 3; ++axis) {
+            double size = m_boxMax[axis] - m_boxMin[axis];
+            // Empty and infinite boxes are left alone, padding them would only turn them into NaNs
+            if (!std::isfinite(size) || size >= MIN_SIZE)
+                continue;
 
-        m_boxMax = center + bounds;
-        m_boxMin = center - bounds;
+            double center = (m_boxMax[axis] + m_boxMin[axis]) * 0.5;
+            m_boxMin[axis] = center - MIN_SIZE * 0.5;
+            m_boxMax[axis] = center + MIN_SIZE * 0.5;
+        }
     }
 };
 
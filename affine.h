@@ -0,0 +1,124 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include "utilities.h"
+#include "aabb.h"
+
+/*
+    3x4 affine matrix: a 3x3 linear part plus a translation column.
+    Composition reads right to left like regular matrices, so (a * b) applies b first.
+*/
+class Affine {
+    public:
+        double m[3][4];
+
+        Affine() : m{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} } {}
+
+        static Affine translation(const vec3& offset) {
+            Affine a;
+            a.m[0][3] = offset[0];
+            a.m[1][3] = offset[1];
+            a.m[2][3] = offset[2];
+            return a;
+        }
+
+        static Affine scaling(const vec3& s) {
+            Affine a;
+            a.m[0][0] = s[0];
+            a.m[1][1] = s[1];
+            a.m[2][2] = s[2];
+            return a;
+        }
+
+        // Counter clockwise rotation (looking down the axis) by angle degrees, Rodrigues' formula
+        static Affine rotation(const vec3& axis, double angle) {
+            vec3 k = unit_vector(axis);
+            double rad = degrees_to_radians(angle);
+            double c = std::cos(rad), s = std::sin(rad), t = 1 - c;
+
+            Affine a;
+            a.m[0][0] = t*k[0]*k[0] + c;      a.m[0][1] = t*k[0]*k[1] - s*k[2]; a.m[0][2] = t*k[0]*k[2] + s*k[1];
+            a.m[1][0] = t*k[0]*k[1] + s*k[2]; a.m[1][1] = t*k[1]*k[1] + c;      a.m[1][2] = t*k[1]*k[2] - s*k[0];
+            a.m[2][0] = t*k[0]*k[2] - s*k[1]; a.m[2][1] = t*k[1]*k[2] + s*k[0]; a.m[2][2] = t*k[2]*k[2] + c;
+            return a;
+        }
+
+        point3 applyPoint(const point3& p) const {
+            return point3(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                          m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                          m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+
+        vec3 applyVector(const vec3& v) const {
+            return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                        m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                        m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+
+        // Multiplies by the transpose of the linear part. Called on the inverse matrix, this is how normals
+        // are carried from object to world space.
+        vec3 applyTransposed(const vec3& v) const {
+            return vec3(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                        m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                        m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+        }
+
+        // Bounds of the transformed box without transforming all eight corners (Arvo, Graphics Gems 1990)
+        AABB applyBox(const AABB& box) const {
+            point3 lo, hi;
+            for (int i = 0; i < 3; ++i) {
+                lo[i] = hi[i] = m[i][3];
+                for (int j = 0; j < 3; ++j) {
+                    double a = m[i][j] * box.m_boxMin[j];
+                    double b = m[i][j] * box.m_boxMax[j];
+                    lo[i] += std::fmin(a, b);
+                    hi[i] += std::fmax(a, b);
+                }
+            }
+            return AABB(lo, hi);
+        }
+
+        Affine operator*(const Affine& b) const {
+            Affine r;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    r.m[i][j] = m[i][0]*b.m[0][j] + m[i][1]*b.m[1][j] + m[i][2]*b.m[2][j] + (j == 3 ? m[i][3] : 0);
+                }
+            }
+            return r;
+        }
+
+        // Of the linear part, the factor it scales volumes by
+        double determinant() const {
+            return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                 + m[0][1] * (m[1][2]*m[2][0] - m[1][0]*m[2][2])
+                 + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        }
+
+        Affine inverse() const {
+            // Inverse of the linear part from its cofactors, then the translation is pulled back through it
+            double c00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+            double c01 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+            double c02 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+            double invDet = 1.0 / (m[0][0]*c00 + m[0][1]*c01 + m[0][2]*c02);
+
+            Affine r;
+            r.m[0][0] = c00 * invDet;
+            r.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * invDet;
+            r.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * invDet;
+            r.m[1][0] = c01 * invDet;
+            r.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * invDet;
+            r.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * invDet;
+            r.m[2][0] = c02 * invDet;
+            r.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * invDet;
+            r.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * invDet;
+
+            vec3 t = r.applyVector(vec3(m[0][3], m[1][3], m[2][3]));
+            r.m[0][3] = -t[0];
+            r.m[1][3] = -t[1];
+            r.m[2][3] = -t[2];
+            return r;
+        }
+};
+
+#endif
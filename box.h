@@ -12,6 +12,29 @@ class Box : public Hittable, public AABB {
         };
 
         bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            if (!intersect(m_boxMin, m_boxMax, r, ray_t, rec.t))
+                return false;
+
+            rec.object = this;
+            return true;
+        }
+
+        void evaluate(const Ray& r, Hit_Record& rec) const override {
+            evaluateSurface(m_boxMin, m_boxMax, r, rec);
+            rec.mat = m_mat.get();
+        }
+
+        AABB getBoundingBox() const override {
+            return AABB(m_boxMin, m_boxMax);
+        }
+
+        // Kernels shared with CompiledScene, which keeps box data in flat arrays
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            double t;
+            return intersect(m_boxMin, m_boxMax, r, ray_t, t);
+        }
+
+        static bool intersect(const point3& boxMin, const point3& boxMax, const Ray& r, const Interval& ray_t, double& t) {
             double tmin = numeric_limits<double>::lowest(), tmax = numeric_limits<double>::max();
             vec3 ndir = (r.direction());           
             vec3 dirfrac;
@@ -19,12 +42,12 @@ class Box : public Hittable, public AABB {
             dirfrac[1] = 1.0f / ndir[1];
             dirfrac[2] = 1.0f / ndir[2];
 
-            double t1 = (m_boxMin[0] - r.origin()[0])*dirfrac[0];
-            double t2 = (m_boxMax[0] - r.origin()[0])*dirfrac[0];
-            double t3 = (m_boxMin[1] - r.origin()[1])*dirfrac[1];
-            double t4 = (m_boxMax[1] - r.origin()[1])*dirfrac[1];
-            double t5 = (m_boxMin[2] - r.origin()[2])*dirfrac[2];
-            double t6 = (m_boxMax[2] - r.origin()[2])*dirfrac[2];
+            double t1 = (boxMin[0] - r.origin()[0])*dirfrac[0];
+            double t2 = (boxMax[0] - r.origin()[0])*dirfrac[0];
+            double t3 = (boxMin[1] - r.origin()[1])*dirfrac[1];
+            double t4 = (boxMax[1] - r.origin()[1])*dirfrac[1];
+            double t5 = (boxMin[2] - r.origin()[2])*dirfrac[2];
+            double t6 = (boxMax[2] - r.origin()[2])*dirfrac[2];
 
             tmin = max(max(min(t1, t2), min(t3, t4)), min(t5, t6));
             tmax = min(min(max(t1, t2), max(t3, t4)), max(t5, t6));
@@ -48,39 +71,37 @@ class Box : public Hittable, public AABB {
                 else
                     root = tmax;
             } 
-            rec.t = root;
+            t = root;
+            return true;
+        }
+
+        static void evaluateSurface(const point3& boxMin, const point3& boxMax, const Ray& r, Hit_Record& rec) {
             rec.p = r.at(rec.t);
-            vec3 out_norm = (rec.p - (m_boxMin + m_boxMax)*0.5);
-            double dotX = abs(dot(vec3::right(), out_norm));
-            double dotY = abs(dot(vec3::up(), out_norm));
-            double dotZ = abs(dot(vec3::forward(), out_norm));
-            
-            if(root == t1)
-                out_norm = -vec3::right();
-            else if (root == t2)
-                out_norm = vec3::right();
-            else if(root == t3)
-                out_norm = -vec3::up();
-            else if (root == t4)
-                out_norm = vec3::up();
-            else if(root == t5)
-                out_norm = -vec3::forward();
-            else if (root == t6)
-                out_norm = vec3::forward();
-
-            out_norm = unit_vector(out_norm);
+
+            // The face is the axis where the hit point sits furthest out, relative to the half extents
+            vec3 half = (boxMax - boxMin)*0.5;
+            vec3 local = rec.p - (boxMin + boxMax)*0.5;
+            int axis = 0;
+            double furthest = -1;
+            for (int a = 0; a < 3; ++a) {
+                double d = fabs(local[a]) / half[a];
+                if (d > furthest) {
+                    furthest = d;
+                    axis = a;
+                }
+            }
+            vec3 out_norm(0, 0, 0);
+            out_norm[axis] = local[axis] < 0 ? -1 : 1;
+
             rec.set_face_normal(r, out_norm);
-            rec.mat = m_mat;
+            rec.set_partials(vec3(), vec3());
             rec.u = 1;
             rec.v = 1;
-            return true;
-        }
-
-        AABB getBoundingBox() const override {
-            return AABB(m_boxMin, m_boxMax);
         }
 
     private:
+        friend class CompiledScene;
+
         shared_ptr<Material> m_mat;
 };
 
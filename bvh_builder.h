@@ -0,0 +1,685 @@
+#ifndef BVH_BUILDER_H
+#define BVH_BUILDER_H
+
+#include "utilities.h"
+#include "aabb.h"
+#include "thread_pool.h"
+#include "radix_sort.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/*
+    Flattened BVH node, 32 bytes so two fit in a cache line.
+    Nodes are stored depth first: an interior node's first child sits right after it in the array and only the
+    offset of the second child is stored. Leaves reference a contiguous range of the primitive array.
+    Bounds are floats rounded outward so the box never shrinks compared to the double precision original.
+*/
+struct LinearBVHNode {
+    float boundsMin[3];
+    float boundsMax[3];
+    union {
+        uint32_t primitivesOffset;   // Leaf
+        uint32_t secondChildOffset;  // Interior
+    };
+    uint16_t primitiveCount;         // 0 for interior nodes
+    uint8_t axis;                    // Interior split axis, decides which child is visited first
+    uint8_t pad;
+
+    bool isLeaf() const { return primitiveCount > 0; }
+
+    void setBounds(const AABB& box) {
+        for (int a = 0; a < 3; ++a) {
+            boundsMin[a] = roundDown(box.m_boxMin[a]);
+            boundsMax[a] = roundUp(box.m_boxMax[a]);
+        }
+    }
+
+    AABB bounds() const {
+        return AABB(point3(boundsMin[0], boundsMin[1], boundsMin[2]), point3(boundsMax[0], boundsMax[1], boundsMax[2]));
+    }
+
+    // Slab test against the ray's precomputed inverse direction
+    bool hit(const point3& orig, const vec3& invDir, double tmin, double tmax) const {
+        for (int a = 0; a < 3; ++a) {
+            double t0 = (boundsMin[a] - orig[a]) * invDir[a];
+            double t1 = (boundsMax[a] - orig[a]) * invDir[a];
+            if (invDir[a] < 0)
+                std::swap(t0, t1);
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmax < tmin)
+                return false;
+        }
+        return true;
+    }
+
+    static float roundDown(double x) {
+        float f = float(x);
+        return double(f) > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float roundUp(double x) {
+        float f = float(x);
+        return double(f) < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should stay 32 bytes");
+
+// Traversal keeps an explicit stack of this many entries, so builders never produce deeper trees
+static const int BVH_MAX_DEPTH = 64;
+
+/*
+    Binned surface area heuristic builder.
+
+    Every primitive's bounds and centroid are computed once up front. At each node the centroids are dropped
+    into BIN_COUNT bins along all three axes and the cheapest of the candidate planes is kept, or the node
+    becomes a leaf if splitting would not pay off and it holds at most max_leaf_size primitives.
+
+    Large scenes are built in parallel: the top of the tree is split on the calling thread (binning big nodes
+    in chunks across the pool) until the remaining subtrees are small enough, then those subtrees are built
+    as independent jobs. Subtrees own disjoint ranges of the primitive array, so they never share state.
+*/
+class SAHBuilder {
+    public:
+        explicit SAHBuilder(int max_leaf_size = 4) : m_maxLeafSize(std::clamp(max_leaf_size, 1, 255)) {}
+
+        // Builds a tree over primBounds. primOrder[i] is the index (into primBounds) of the i-th primitive in
+        // leaf order, which is the order leaves' primitivesOffset ranges refer to.
+        void build(const std::vector<AABB>& primBounds, std::vector<LinearBVHNode>& nodes, std::vector<uint32_t>& primOrder) const {
+            nodes.clear();
+            primOrder.clear();
+            if (primBounds.empty())
+                return;
+
+            std::vector<PrimitiveInfo> prims(primBounds.size());
+            for (size_t i = 0; i < primBounds.size(); ++i)
+                prims[i] = PrimitiveInfo{ primBounds[i], primBounds[i].centroid(), uint32_t(i) };
+
+            ThreadPool& pool = globalThreadPool();
+            bool parallel = pool.threadCount() > 0 && prims.size() > PARALLEL_SUBTREE_SIZE;
+
+            std::deque<BuildNode> topArena;
+            std::vector<Subtree> deferred;
+            BuildNode* root = buildRecursive(prims, topArena, 0, prims.size(), 0, parallel ? &deferred : nullptr);
+
+            std::vector<std::deque<BuildNode>> arenas(deferred.size());
+            pool.parallelFor(int(deferred.size()), [&](int i) {
+                const Subtree& task = deferred[i];
+                *task.node = *buildRecursive(prims, arenas[i], task.start, task.end, task.depth, nullptr);
+            });
+
+            nodes.reserve(2 * prims.size() / m_maxLeafSize + 1);
+            flatten(root, nodes);
+
+            primOrder.resize(prims.size());
+            for (size_t i = 0; i < prims.size(); ++i)
+                primOrder[i] = prims[i].index;
+        }
+
+    private:
+        static const int BIN_COUNT = 16;
+        static const size_t PARALLEL_SUBTREE_SIZE = 8192;  // Subtrees at or below this are built as one job
+        static const size_t PARALLEL_BIN_SIZE = 65536;     // Nodes above this are binned across the pool
+        static const size_t BIN_CHUNK_SIZE = 16384;
+        static const int SAH_MAX_DEPTH = 32;               // Past this, split at the median to bound the depth
+
+        struct PrimitiveInfo {
+            AABB bounds;
+            point3 centroid;
+            uint32_t index;
+        };
+
+        struct BuildNode {
+            AABB bounds;
+            BuildNode* children[2] = { nullptr, nullptr };
+            int axis = 0;
+            size_t firstPrim = 0;
+            size_t primCount = 0;
+        };
+
+        // Placeholder left in the top of the tree for a subtree that is built later on the pool
+        struct Subtree {
+            BuildNode* node;
+            size_t start, end;
+            int depth;
+        };
+
+        struct Bin {
+            AABB bounds = AABB::empty;
+            size_t count = 0;
+        };
+
+        struct BinSet {
+            Bin bins[3][BIN_COUNT];
+            AABB bounds = AABB::empty;
+
+            void merge(const BinSet& other) {
+                bounds = AABB(bounds, other.bounds);
+                for (int a = 0; a < 3; ++a) {
+                    for (int b = 0; b < BIN_COUNT; ++b) {
+                        bins[a][b].bounds = AABB(bins[a][b].bounds, other.bins[a][b].bounds);
+                        bins[a][b].count += other.bins[a][b].count;
+                    }
+                }
+            }
+        };
+
+        BuildNode* buildRecursive(std::vector<PrimitiveInfo>& prims, std::deque<BuildNode>& arena,
+                                  size_t start, size_t end, int depth, std::vector<Subtree>* deferred) const {
+            arena.emplace_back();
+            BuildNode* node = &arena.back();
+            size_t count = end - start;
+
+            if (deferred && count <= PARALLEL_SUBTREE_SIZE) {
+                deferred->push_back(Subtree{ node, start, end, depth });
+                return node;
+            }
+
+            // Bounds of the primitives and of their centroids, the latter decides where splits can go
+            point3 cmin(infinity), cmax(-infinity);
+            AABB bounds = AABB::empty;
+            for (size_t i = start; i < end; ++i) {
+                bounds = AABB(bounds, prims[i].bounds);
+                cmin = min(cmin, prims[i].centroid);
+                cmax = max(cmax, prims[i].centroid);
+            }
+            node->bounds = bounds;
+
+            if (count == 1)
+                return makeLeaf(node, start, count);
+
+            vec3 extent = cmax - cmin;
+            int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+            size_t mid = start + count / 2;
+
+            if (extent[axis] <= 0) {
+                // Every centroid coincides, no plane can separate them
+                if (count <= 0xFFFF)
+                    return makeLeaf(node, start, count);
+            } else if (depth >= SAH_MAX_DEPTH) {
+                std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                    [axis](const PrimitiveInfo& a, const PrimitiveInfo& b) { return a.centroid[axis] < b.centroid[axis]; });
+            } else {
+                BinSet bins = binPrimitives(prims, start, end, cmin, extent);
+
+                double bestCost = infinity;
+                int bestBin = -1;
+                for (int a = 0; a < 3; ++a) {
+                    if (extent[a] <= 0)
+                        continue;
+
+                    // Sweep from the right to get the cost of everything above each plane, then from the left
+                    double costAbove[BIN_COUNT];
+                    AABB boxAbove = AABB::empty;
+                    size_t countAbove = 0;
+                    for (int b = BIN_COUNT - 1; b > 0; --b) {
+                        boxAbove = AABB(boxAbove, bins.bins[a][b].bounds);
+                        countAbove += bins.bins[a][b].count;
+                        costAbove[b] = countAbove * boxAbove.surfaceArea();
+                    }
+
+                    AABB boxBelow = AABB::empty;
+                    size_t countBelow = 0;
+                    for (int b = 0; b < BIN_COUNT - 1; ++b) {
+                        boxBelow = AABB(boxBelow, bins.bins[a][b].bounds);
+                        countBelow += bins.bins[a][b].count;
+                        double cost = countBelow * boxBelow.surfaceArea() + costAbove[b + 1];
+                        if (countBelow > 0 && countBelow < count && cost < bestCost) {
+                            bestCost = cost;
+                            bestBin = b;
+                            axis = a;
+                        }
+                    }
+                }
+
+                // Traversal step costs about half of a primitive test
+                double leafCost = double(count);
+                double splitCost = 0.5 + bestCost / bounds.surfaceArea();
+                if (bestBin < 0 || (count <= m_maxLeafSize && leafCost <= splitCost))
+                    return makeLeaf(node, start, count);
+
+                double lo = cmin[axis], scale = BIN_COUNT / extent[axis];
+                auto it = std::partition(prims.begin() + start, prims.begin() + end, [=](const PrimitiveInfo& p) {
+                    return binIndex(p.centroid[axis], lo, scale) <= bestBin;
+                });
+                mid = size_t(it - prims.begin());
+            }
+
+            node->axis = axis;
+            node->children[0] = buildRecursive(prims, arena, start, mid, depth + 1, deferred);
+            node->children[1] = buildRecursive(prims, arena, mid, end, depth + 1, deferred);
+            return node;
+        }
+
+        BuildNode* makeLeaf(BuildNode* node, size_t start, size_t count) const {
+            node->firstPrim = start;
+            node->primCount = count;
+            return node;
+        }
+
+        static int binIndex(double c, double lo, double scale) {
+            int b = int((c - lo) * scale);
+            return b < 0 ? 0 : (b >= BIN_COUNT ? BIN_COUNT - 1 : b);
+        }
+
+        BinSet binPrimitives(const std::vector<PrimitiveInfo>& prims, size_t start, size_t end, const point3& cmin, const vec3& extent) const {
+            vec3 scale;
+            for (int a = 0; a < 3; ++a)
+                scale[a] = extent[a] > 0 ? BIN_COUNT / extent[a] : 0;
+
+            auto binRange = [&](size_t from, size_t to, BinSet& out) {
+                for (size_t i = from; i < to; ++i) {
+                    for (int a = 0; a < 3; ++a) {
+                        Bin& bin = out.bins[a][binIndex(prims[i].centroid[a], cmin[a], scale[a])];
+                        bin.bounds = AABB(bin.bounds, prims[i].bounds);
+                        ++bin.count;
+                    }
+                }
+            };
+
+            BinSet result;
+            size_t count = end - start;
+            if (count <= PARALLEL_BIN_SIZE) {
+                binRange(start, end, result);
+                return result;
+            }
+
+            int chunks = int((count + BIN_CHUNK_SIZE - 1) / BIN_CHUNK_SIZE);
+            std::vector<BinSet> partial(chunks);
+            globalThreadPool().parallelFor(chunks, [&](int c) {
+                size_t from = start + size_t(c) * BIN_CHUNK_SIZE;
+                binRange(from, std::min(end, from + BIN_CHUNK_SIZE), partial[c]);
+            });
+            for (const BinSet& p : partial)
+                result.merge(p);
+            return result;
+        }
+
+        static uint32_t flatten(const BuildNode* node, std::vector<LinearBVHNode>& nodes) {
+            uint32_t idx = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[idx].setBounds(node->bounds);
+            nodes[idx].pad = 0;
+
+            if (node->primCount > 0) {
+                nodes[idx].primitivesOffset = uint32_t(node->firstPrim);
+                nodes[idx].primitiveCount = uint16_t(node->primCount);
+                nodes[idx].axis = 0;
+            } else {
+                flatten(node->children[0], nodes);
+                uint32_t second = flatten(node->children[1], nodes);
+                nodes[idx].secondChildOffset = second;
+                nodes[idx].primitiveCount = 0;
+                nodes[idx].axis = uint8_t(node->axis);
+            }
+            return idx;
+        }
+
+        size_t m_maxLeafSize;
+};
+
+/*
+    Linear BVH builder (Karras 2012, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees").
+
+    Much faster to build than SAH, at the cost of tree quality:
+      1. Primitive centroids are quantized to 21 bits per axis and interleaved into 63-bit Morton codes.
+      2. The codes are sorted with a parallel LSD radix sort (per-chunk histograms, then a stable scatter).
+      3. Every interior node of the radix tree over the sorted codes is found independently from its index,
+         so the whole hierarchy is emitted in one parallel pass.
+      4. A last pass flattens the radix tree into LinearBVHNodes and computes bounds. Any subtree holding at
+         most max_leaf_size primitives becomes a single leaf since its primitives are already contiguous.
+
+    With sah_upper_levels (BVHBuildMethod::HLBVH) primitives are first grouped into clusters sharing the top
+    12 bits of their code, each cluster gets its own radix tree, and the tree over the clusters is built with
+    SAH. Most of the quality lost to Morton ordering is in those top levels, where the splits are the biggest.
+*/
+class LBVHBuilder {
+    public:
+        explicit LBVHBuilder(int max_leaf_size = 4, bool sah_upper_levels = false)
+            : m_maxLeafSize(std::clamp(max_leaf_size, 1, 255)), m_sahUpperLevels(sah_upper_levels) {}
+
+        // Same contract as SAHBuilder::build
+        void build(const std::vector<AABB>& primBounds, std::vector<LinearBVHNode>& nodes, std::vector<uint32_t>& primOrder) const {
+            nodes.clear();
+            primOrder.clear();
+            size_t n = primBounds.size();
+            if (n == 0)
+                return;
+
+            ThreadPool& pool = globalThreadPool();
+            int chunks = int((n + CHUNK_SIZE - 1) / CHUNK_SIZE);
+            auto chunkRange = [n](int c, size_t& from, size_t& to) {
+                from = size_t(c) * CHUNK_SIZE;
+                to = std::min(n, from + CHUNK_SIZE);
+            };
+
+            // Centroid bounds, needed to quantize the centroids
+            std::vector<point3> chunkMin(chunks, point3(infinity)), chunkMax(chunks, point3(-infinity));
+            pool.parallelFor(chunks, [&](int c) {
+                size_t from, to;
+                chunkRange(c, from, to);
+                for (size_t i = from; i < to; ++i) {
+                    point3 centroid = primBounds[i].centroid();
+                    chunkMin[c] = min(chunkMin[c], centroid);
+                    chunkMax[c] = max(chunkMax[c], centroid);
+                }
+            });
+            point3 cmin(infinity), cmax(-infinity);
+            for (int c = 0; c < chunks; ++c) {
+                cmin = min(cmin, chunkMin[c]);
+                cmax = max(cmax, chunkMax[c]);
+            }
+
+            vec3 scale;
+            for (int a = 0; a < 3; ++a)
+                scale[a] = cmax[a] > cmin[a] ? MORTON_SCALE / (cmax[a] - cmin[a]) : 0;
+
+            std::vector<MortonPrimitive> sorted(n);
+            pool.parallelFor(chunks, [&](int c) {
+                size_t from, to;
+                chunkRange(c, from, to);
+                for (size_t i = from; i < to; ++i) {
+                    point3 centroid = primBounds[i].centroid();
+                    uint32_t q[3];
+                    for (int a = 0; a < 3; ++a)
+                        q[a] = uint32_t(std::clamp((centroid[a] - cmin[a]) * scale[a], 0.0, MORTON_SCALE));
+                    sorted[i] = MortonPrimitive{ encodeMorton3(q[0], q[1], q[2]), uint32_t(i) };
+                }
+            });
+
+            parallelRadixSort(sorted, pool, 63);
+
+            BuildState state{ sorted, std::vector<AABB>(n), std::vector<RadixNode>(n), nodes };
+            primOrder.resize(n);
+            pool.parallelFor(chunks, [&](int c) {
+                size_t from, to;
+                chunkRange(c, from, to);
+                for (size_t i = from; i < to; ++i) {
+                    primOrder[i] = sorted[i].index;
+                    state.bounds[i] = primBounds[sorted[i].index];
+                }
+            });
+
+            // Clusters are runs of primitives sharing the top bits of their code. Without SAH upper levels
+            // everything is one cluster.
+            std::vector<Cluster> clusters;
+            std::vector<uint32_t> clusterOf(n);
+            size_t begin = 0;
+            for (size_t i = 1; i <= n; ++i) {
+                bool boundary = i == n || (m_sahUpperLevels && (sorted[i].code >> CLUSTER_SHIFT) != (sorted[begin].code >> CLUSTER_SHIFT));
+                if (boundary) {
+                    clusters.push_back(Cluster{ uint32_t(begin), uint32_t(i) });
+                    begin = i;
+                }
+            }
+            for (uint32_t c = 0; c < clusters.size(); ++c)
+                std::fill(clusterOf.begin() + clusters[c].begin, clusterOf.begin() + clusters[c].end, c);
+
+            // Every interior node of every cluster's radix tree, all independent of each other
+            pool.parallelFor(chunks, [&](int c) {
+                size_t from, to;
+                chunkRange(c, from, to);
+                for (size_t i = from; i < to; ++i) {
+                    const Cluster& cluster = clusters[clusterOf[i]];
+                    if (i + 1 < cluster.end)
+                        state.radix[i] = findRadixNode(sorted, int64_t(i), cluster.begin, cluster.end);
+                }
+            });
+
+            nodes.reserve(2 * n / m_maxLeafSize + 1);
+            AABB rootBounds;
+            if (clusters.size() == 1) {
+                emitCluster(state, clusters[0], 0, rootBounds);
+                return;
+            }
+
+            std::vector<AABB> clusterBounds(clusters.size());
+            pool.parallelFor(int(clusters.size()), [&](int c) {
+                AABB box = AABB::empty;
+                for (uint32_t i = clusters[c].begin; i < clusters[c].end; ++i)
+                    box = AABB(box, state.bounds[i]);
+                clusterBounds[c] = box;
+            });
+
+            std::vector<LinearBVHNode> top;
+            std::vector<uint32_t> clusterOrder;
+            SAHBuilder(1).build(clusterBounds, top, clusterOrder);
+            emitTop(state, clusters, top, clusterOrder, 0, 0, rootBounds);
+        }
+
+    private:
+        static const size_t CHUNK_SIZE = 16384;
+        static constexpr double MORTON_SCALE = double((1 << 21) - 1);
+        static const int CLUSTER_SHIFT = 63 - 12;
+        static const int MEDIAN_DEPTH = BVH_MAX_DEPTH - 32;  // Past this, split ranges at the median
+        static const uint32_t LEAF_BIT = 0x80000000u;
+
+        struct MortonPrimitive {
+            uint64_t code;
+            uint32_t index;
+        };
+
+        struct Cluster {
+            uint32_t begin, end;
+        };
+
+        // Children are positions in the sorted array, either of a single primitive (LEAF_BIT set) or of
+        // another radix node. [first, last] is the range of sorted primitives under the node.
+        struct RadixNode {
+            uint32_t children[2];
+            uint32_t first, last;
+        };
+
+        struct BuildState {
+            const std::vector<MortonPrimitive>& sorted;
+            std::vector<AABB> bounds;       // Primitive bounds in sorted order
+            std::vector<RadixNode> radix;   // Interior node i of a cluster lives at the cluster's begin + i
+            std::vector<LinearBVHNode>& nodes;
+        };
+
+        static uint64_t expandBits21(uint64_t v) {
+            v &= 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffull;
+            v = (v | v << 16) & 0x1f0000ff0000ffull;
+            v = (v | v << 8)  & 0x100f00f00f00f00full;
+            v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+            v = (v | v << 2)  & 0x1249249249249249ull;
+            return v;
+        }
+
+        static uint64_t encodeMorton3(uint32_t x, uint32_t y, uint32_t z) {
+            return (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+        }
+
+        static int countLeadingZeros(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+            return v == 0 ? 64 : __builtin_clzll(v);
+#else
+            int n = 0;
+            for (uint64_t bit = 1ull << 63; bit && !(v & bit); bit >>= 1)
+                ++n;
+            return n;
+#endif
+        }
+
+        // Length of the common prefix of the codes at i and j, -1 outside [begin, end). Equal codes fall back
+        // to comparing the indices so every key is unique.
+        static int commonPrefix(const std::vector<MortonPrimitive>& sorted, int64_t i, int64_t j, int64_t begin, int64_t end) {
+            if (j < begin || j >= end)
+                return -1;
+            uint64_t a = sorted[i].code, b = sorted[j].code;
+            if (a == b)
+                return 64 + countLeadingZeros(uint64_t(i ^ j));
+            return countLeadingZeros(a ^ b);
+        }
+
+        static RadixNode findRadixNode(const std::vector<MortonPrimitive>& sorted, int64_t i, int64_t begin, int64_t end) {
+            // Direction of the node's range from i, then its length by exponential and binary search
+            int d = commonPrefix(sorted, i, i + 1, begin, end) - commonPrefix(sorted, i, i - 1, begin, end) > 0 ? 1 : -1;
+            int minPrefix = commonPrefix(sorted, i, i - d, begin, end);
+
+            int64_t maxLength = 2;
+            while (commonPrefix(sorted, i, i + maxLength * d, begin, end) > minPrefix)
+                maxLength *= 2;
+
+            int64_t length = 0;
+            for (int64_t t = maxLength / 2; t >= 1; t /= 2) {
+                if (commonPrefix(sorted, i, i + (length + t) * d, begin, end) > minPrefix)
+                    length += t;
+            }
+            int64_t j = i + length * d;
+
+            // Split position: the last primitive sharing more than the node's prefix with i
+            int nodePrefix = commonPrefix(sorted, i, j, begin, end);
+            int64_t split = 0;
+            for (int64_t div = 2; ; div *= 2) {
+                int64_t t = (length + div - 1) / div;
+                if (commonPrefix(sorted, i, i + (split + t) * d, begin, end) > nodePrefix)
+                    split += t;
+                if (t == 1)
+                    break;
+            }
+            int64_t gamma = i + split * d + std::min(d, 0);
+
+            RadixNode node;
+            node.first = uint32_t(std::min(i, j));
+            node.last = uint32_t(std::max(i, j));
+            node.children[0] = uint32_t(gamma) | (node.first == gamma ? LEAF_BIT : 0);
+            node.children[1] = uint32_t(gamma + 1) | (node.last == gamma + 1 ? LEAF_BIT : 0);
+            return node;
+        }
+
+        uint32_t emitLeaf(BuildState& state, uint32_t first, uint32_t end, AABB& bounds) const {
+            bounds = AABB::empty;
+            for (uint32_t i = first; i < end; ++i)
+                bounds = AABB(bounds, state.bounds[i]);
+
+            uint32_t idx = uint32_t(state.nodes.size());
+            state.nodes.emplace_back();
+            LinearBVHNode& leaf = state.nodes[idx];
+            leaf.setBounds(bounds);
+            leaf.primitivesOffset = first;
+            leaf.primitiveCount = uint16_t(end - first);
+            leaf.axis = 0;
+            leaf.pad = 0;
+            return idx;
+        }
+
+        // Axis of the highest bit where two codes differ. The primitives below that bit's 0 are on the low
+        // side of that axis, which is what near-first traversal expects of the first child.
+        static int splitAxis(uint64_t a, uint64_t b) {
+            if (a == b)
+                return 0;
+            int bit = 63 - countLeadingZeros(a ^ b);
+            return 2 - bit % 3;
+        }
+
+        template<typename EmitChild>
+        uint32_t emitInterior(BuildState& state, int axis, AABB& bounds, EmitChild emitChild) const {
+            uint32_t idx = uint32_t(state.nodes.size());
+            state.nodes.emplace_back();
+
+            AABB left, right;
+            emitChild(0, left);
+            uint32_t second = emitChild(1, right);
+            bounds = AABB(left, right);
+
+            // Children may have grown the array, so look the node up again
+            LinearBVHNode& node = state.nodes[idx];
+            node.setBounds(bounds);
+            node.secondChildOffset = second;
+            node.primitiveCount = 0;
+            node.axis = uint8_t(axis);
+            node.pad = 0;
+            return idx;
+        }
+
+        uint32_t emitRange(BuildState& state, uint32_t first, uint32_t end, AABB& bounds) const {
+            if (end - first <= m_maxLeafSize)
+                return emitLeaf(state, first, end, bounds);
+            uint32_t mid = first + (end - first) / 2;
+            int axis = splitAxis(state.sorted[first].code, state.sorted[end - 1].code);
+            return emitInterior(state, axis, bounds, [&](int child, AABB& childBounds) {
+                return child == 0 ? emitRange(state, first, mid, childBounds) : emitRange(state, mid, end, childBounds);
+            });
+        }
+
+        uint32_t emitRadix(BuildState& state, uint32_t ref, int depth, AABB& bounds) const {
+            if (ref & LEAF_BIT) {
+                uint32_t pos = ref & ~LEAF_BIT;
+                return emitLeaf(state, pos, pos + 1, bounds);
+            }
+
+            const RadixNode& node = state.radix[ref];
+            uint32_t count = node.last - node.first + 1;
+            if (count <= m_maxLeafSize)
+                return emitLeaf(state, node.first, node.last + 1, bounds);
+            if (depth >= MEDIAN_DEPTH)
+                return emitRange(state, node.first, node.last + 1, bounds);
+
+            int axis = splitAxis(state.sorted[node.first].code, state.sorted[node.last].code);
+            return emitInterior(state, axis, bounds, [&](int child, AABB& childBounds) {
+                return emitRadix(state, node.children[child], depth + 1, childBounds);
+            });
+        }
+
+        uint32_t emitCluster(BuildState& state, const Cluster& cluster, int depth, AABB& bounds) const {
+            // A single primitive cluster has no radix node, its root is the primitive itself
+            uint32_t root = cluster.end - cluster.begin == 1 ? (cluster.begin | LEAF_BIT) : cluster.begin;
+            return emitRadix(state, root, depth, bounds);
+        }
+
+        uint32_t emitTop(BuildState& state, const std::vector<Cluster>& clusters, const std::vector<LinearBVHNode>& top,
+                         const std::vector<uint32_t>& clusterOrder, uint32_t topIdx, int depth, AABB& bounds) const {
+            const LinearBVHNode& node = top[topIdx];
+            if (node.isLeaf())
+                return emitClusterList(state, clusters, &clusterOrder[node.primitivesOffset], node.primitiveCount, depth, bounds);
+
+            return emitInterior(state, node.axis, bounds, [&](int child, AABB& childBounds) {
+                uint32_t childIdx = child == 0 ? topIdx + 1 : node.secondChildOffset;
+                return emitTop(state, clusters, top, clusterOrder, childIdx, depth + 1, childBounds);
+            });
+        }
+
+        // SAH leaves over clusters normally hold one cluster, but coincident centroids can put several in one
+        uint32_t emitClusterList(BuildState& state, const std::vector<Cluster>& clusters, const uint32_t* list,
+                                 uint32_t count, int depth, AABB& bounds) const {
+            if (count == 1)
+                return emitCluster(state, clusters[list[0]], depth, bounds);
+            uint32_t half = count / 2;
+            return emitInterior(state, 0, bounds, [&](int child, AABB& childBounds) {
+                return child == 0 ? emitClusterList(state, clusters, list, half, depth + 1, childBounds)
+                                  : emitClusterList(state, clusters, list + half, count - half, depth + 1, childBounds);
+            });
+        }
+
+        size_t m_maxLeafSize;
+        bool m_sahUpperLevels;
+};
+
+enum class BVHBuildMethod {
+    SAH,    // Binned SAH, best trees
+    LBVH,   // Morton order radix tree, fastest build
+    HLBVH   // LBVH inside spatial clusters, SAH over the clusters
+};
+
+// How a built tree is laid out for traversal
+enum class BVHLayout {
+    Binary,  // LinearBVHNodes as built
+    Wide4,   // Collapsed to 4 children per node, see WideBVHTree
+    Wide8    // 8 children per node, tested with AVX when the compiler targets it
+};
+
+inline void buildBVH(BVHBuildMethod method, int max_leaf_size, const std::vector<AABB>& primBounds,
+                     std::vector<LinearBVHNode>& nodes, std::vector<uint32_t>& primOrder) {
+    if (method == BVHBuildMethod::SAH)
+        SAHBuilder(max_leaf_size).build(primBounds, nodes, primOrder);
+    else
+        LBVHBuilder(max_leaf_size, method == BVHBuildMethod::HLBVH).build(primBounds, nodes, primOrder);
+}
+
+#endif
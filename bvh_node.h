@@ -3,69 +3,180 @@
 
 #include "utilities.h"
 #include "hittable_list.h"
+#include "bvh_builder.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <vector>
 
 class BVH_Node : public Hittable {
     public:
-        BVH_Node(Hittable_List hitlist) : BVH_Node(hitlist.objects, 0, hitlist.objects.size()) {};
-        BVH_Node(vector<shared_ptr<Hittable>>& objects, size_t start, size_t end) {
+        BVH_Node(Hittable_List hitlist, int max_leaf_size = 4, BVHBuildMethod method = BVHBuildMethod::SAH)
+            : BVH_Node(hitlist.objects, 0, hitlist.objects.size(), max_leaf_size, method) {};
+        BVH_Node(vector<shared_ptr<Hittable>>& objects, size_t start, size_t end, int max_leaf_size = 4,
+                 BVHBuildMethod method = BVHBuildMethod::SAH) {
+            // Ask each primitive for its bounds exactly once, the builder works from this copy
+            std::vector<AABB> primBounds(end - start);
             m_aabb = AABB::empty;
-            for(size_t idx = start; idx < end; ++idx)
-                m_aabb = AABB(m_aabb, objects[idx]->getBoundingBox());
-
-            size_t objCount = end - start;
-            if(objCount == 1) {
-                m_left = m_right = objects[start];
-            } else if (objCount == 2) {
-                m_left  = objects[start];
-                m_right = objects[start + 1];
-            } else {
-                int splitAxis = m_aabb.longestAxis();
-
-                auto comperator = (splitAxis == 0) ? compareAABB_x :
-                                  (splitAxis == 1) ? compareAABB_y :
-                                                     compareAABB_z;
-                                                     
-
-                std::sort(objects.begin() + start, objects.begin() + end, comperator);
-                m_left =  make_shared<BVH_Node>(objects, start, start + objCount / 2);
-                m_right = make_shared<BVH_Node>(objects, start + objCount/2, end);
+            for (size_t idx = start; idx < end; ++idx) {
+                primBounds[idx - start] = objects[idx]->getBoundingBox();
+                m_aabb = AABB(m_aabb, primBounds[idx - start]);
             }
+
+            std::vector<uint32_t> primOrder;
+            buildBVH(method, max_leaf_size, primBounds, m_nodes, primOrder);
+
+            m_primitives.reserve(primOrder.size());
+            for (uint32_t idx : primOrder)
+                m_primitives.push_back(objects[start + idx]);
         }
 
         bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
-            if(!m_aabb.hit(r, ray_t))
+            if (m_nodes.empty())
                 return false;
 
-            bool hit_left = m_left->hit(r, ray_t, rec);
-            bool hit_right = m_right->hit(r, Interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+            const point3& orig = r.origin();
+            const vec3& invDir = r.inv_direction();
+            bool dirIsNeg[3] = { invDir[0] < 0, invDir[1] < 0, invDir[2] < 0 };
 
-            return hit_left || hit_right;
+            bool hit_anything = false;
+            double closest_so_far = ray_t.max;
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                if (node.hit(orig, invDir, ray_t.min, closest_so_far)) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i) {
+                            if (m_primitives[node.primitivesOffset + i]->hit(r, Interval(ray_t.min, closest_so_far), rec)) {
+                                hit_anything = true;
+                                closest_so_far = rec.t;
+                            }
+                        }
+                        if (toVisitCount == 0)
+                            break;
+                        current = toVisit[--toVisitCount];
+                    } else if (dirIsNeg[node.axis]) {
+                        // Ray travels towards -axis, so the upper child is the near one
+                        toVisit[toVisitCount++] = current + 1;
+                        current = node.secondChildOffset;
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                    }
+                } else {
+                    if (toVisitCount == 0)
+                        break;
+                    current = toVisit[--toVisitCount];
+                }
+            }
+
+            return hit_anything;
         }
 
-        AABB getBoundingBox() const override {
-            return m_aabb;
+        // Any hit ends the walk, so children are pushed in storage order without working out the near one
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            if (m_nodes.empty())
+                return false;
+
+            const point3& orig = r.origin();
+            const vec3& invDir = r.inv_direction();
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                if (node.hit(orig, invDir, ray_t.min, ray_t.max)) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i)
+                            if (m_primitives[node.primitivesOffset + i]->occluded(r, ray_t))
+                                return true;
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                        continue;
+                    }
+                }
+                if (toVisitCount == 0)
+                    return false;
+                current = toVisit[--toVisitCount];
+            }
         }
-    private:
-        static bool compareAABB(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int axis) {
-            return a->getBoundingBox().axisBounds(axis).min < b->getBoundingBox().axisBounds(axis).min;
+
+        // Same walk as occluded(), multiplying up what each primitive lets through until something opaque
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            if (m_nodes.empty())
+                return 1;
+
+            const point3& orig = r.origin();
+            const vec3& invDir = r.inv_direction();
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            double T = 1;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                if (node.hit(orig, invDir, ray_t.min, ray_t.max)) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i) {
+                            T *= m_primitives[node.primitivesOffset + i]->transmittance(r, ray_t);
+                            if (T <= 0)
+                                return 0;
+                        }
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                        continue;
+                    }
+                }
+                if (toVisitCount == 0)
+                    return T;
+                current = toVisit[--toVisitCount];
+            }
         }
-        
-        static bool compareAABB_x(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-            return compareAABB(a, b, 0);
+
+        AABB getBoundingBox() const override {
+            return m_aabb;
         }
-        static bool compareAABB_y(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-            return compareAABB(a, b, 1);
+
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            for (const auto& prim : m_primitives)
+                prim->gatherLights(lights);
         }
-        static bool compareAABB_z(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-            return compareAABB(a, b, 2);
+
+        // In leaf order, so scene compilation can flatten the tree without another build
+        const std::vector<shared_ptr<Hittable>>& primitives() const {
+            return m_primitives;
         }
 
+        // Recomputes every node's bounds from the primitives' current bounds while keeping the topology.
+        // Nodes are stored depth first, so children always sit after their parent and one backwards pass works.
+        void refit() {
+            for (size_t idx = m_nodes.size(); idx-- > 0;) {
+                LinearBVHNode& node = m_nodes[idx];
+                AABB box = AABB::empty;
+                if (node.isLeaf()) {
+                    for (uint32_t i = 0; i < node.primitiveCount; ++i)
+                        box = AABB(box, m_primitives[node.primitivesOffset + i]->getBoundingBox());
+                } else {
+                    box = AABB(m_nodes[idx + 1].bounds(), m_nodes[node.secondChildOffset].bounds());
+                }
+                node.setBounds(box);
+            }
+
+            m_aabb = AABB::empty;
+            for (const auto& prim : m_primitives)
+                m_aabb = AABB(m_aabb, prim->getBoundingBox());
+        }
 
-        shared_ptr<Hittable> m_left;
-        shared_ptr<Hittable> m_right;
+    private:
+        std::vector<LinearBVHNode> m_nodes;
+        std::vector<shared_ptr<Hittable>> m_primitives;  // Reordered so every leaf's primitives are contiguous
         AABB m_aabb;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -5,9 +5,16 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "compiled_scene.h"
+#include "light_bvh.h"
+#include "sampler.h"
 
 #include "thread_pool.h"
+#include "tile_scheduler.h"
+#include "radix_sort.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 using namespace std::chrono;
 
@@ -24,36 +31,81 @@ class Camera {
     vec3   vup      = vec3(0,1,0); 
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
+    int num_threads = 0;       // Workers in the shared thread pool besides the calling thread, 0 for one per hardware thread
+    bool pin_threads = false;  // Pin each worker to its own CPU
+    int tile_size = 16;        // Side of the square tiles handed out to render threads
+    TileOrder tile_order = TileOrder::Hilbert;
+    bool compile_scene = true; // Render lists through a CompiledScene instead of the authored object graph
+    BVHLayout bvh_layout = BVHLayout::Wide4; // Node layout the compiled scene's rays walk, wide layouts have a half or a third of the depth
+    int packet_size = 8;       // Trace primary rays of a compiled scene in packets of 4, 8 or 16. 0 traces them one by one
+    bool adaptive_sampling = false;  // Treat samples_per_pixel as a budget and stop pixels once they converge (tile renderer)
+    int adaptive_min_samples = 16;   // Initial batch every pixel gets before its error is trusted
+    int adaptive_batch = 8;          // Samples added between convergence checks
+    double adaptive_threshold = 0.02; // Target standard error, relative to the pixel's luminance (floored at 0.1)
+    int rr_min_depth = 3;      // Bounces before Russian roulette may end a path, negative turns it off
+    bool wavefront = false;    // Trace in sorted batches stage by stage instead of one path at a time
+    int wavefront_batch = 1 << 18; // Paths in flight at once in wavefront mode
+    SamplerType sampler_type = SamplerType::Sobol; // Source of the pixel, lens, time and per bounce random numbers
+    uint64_t seed = 0;         // Renders are bit identical for a given seed, whatever the thread count or tile order
+    bool light_sampling = true; // Sample emissive quads and spheres directly at every diffuse bounce (MIS weighted)
+    bool ray_differentials = true; // Track each path's pixel footprint through mirrors and glass so textures filter over it
+
+    void render(const Hittable_List& world) {
+        if (!compile_scene) {
+            render(static_cast<const Hittable&>(world));
+            return;
+        }
+
+        CompiledScene compiled(world, 4, BVHBuildMethod::SAH, bvh_layout);
+        render(static_cast<const Hittable&>(compiled));
+    }
 
     void render(const Hittable& world) {
         initialize();
 
+        std::vector<const Hittable*> lights;
+        if (light_sampling)
+            world.gatherLights(lights);
+        scene_lights.build(lights);
+
         cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
         auto start = high_resolution_clock::now();
 #if MT_RENDER
         ray_world = &world;
+        packet_scene = dynamic_cast<const CompiledScene*>(&world);
 
-        threadPool.start();
-        mt_tex = vector<vector<color>>(image_height);
-        for (int j = 0; j < image_height; j++) {
-            threadPool.queueJob([this](int i){ this->mt_render_row(i);},j);
+        configureGlobalThreadPool(uint32_t(std::max(num_threads, 0)), pin_threads);
+        ThreadPool& threadPool = globalThreadPool();
+        mt_tex.assign(size_t(image_width) * image_height, color(0, 0, 0));
+        samples_taken = 0;
+        if (wavefront) {
+            render_wavefront(threadPool);
+        } else {
+            // One extra runner for the calling thread, which works through the queue while it waits
+            int workers = threadPool.threadCount() + 1;
+            tileScheduler.reset(image_width, image_height, tile_size, tile_order, workers);
+            threadPool.queueJobs(workers, [this](int worker){ this->mt_render_tiles(worker);});
+            threadPool.waitForCompletion();
         }
-        threadPool.waitForCompletion();
         clog << "Done with MT! \n" << flush; 
+        if (adaptive_sampling && !wavefront) {
+            long long budget = (long long)image_width * image_height * samples_per_pixel;
+            clog << "Adaptive sampling took " << samples_taken.load() << " of " << budget << " samples\n";
+        }
         for (int i = 0; i < image_height; ++i) {
             for (int j = 0; j < image_width; ++j) {
-                write_color(std::cout, mt_tex[i][j]);
+                write_color(std::cout, mt_tex[size_t(i) * image_width + j]);
             }
         }
-        threadPool.stop();
 #else
+        auto sampler = makeSampler(sampler_type, samples_per_pixel, seed);
         for (int j = 0; j < image_height; j++) {
             clog<<"\rScanline remaining: " << (image_height - j) << ' ' << flush;
             for (int i = 0; i < image_width; i++) {
                 color pixel_color(0, 0, 0);
                 for (int samp = 0; samp < samples_per_pixel; ++samp) {
-                    Ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
+                    Ray r = get_ray(i, j, samp, *sampler);
+                    pixel_color += ray_color(r, max_depth, world, *sampler);
                 }
                 pixel_color *= pixel_sample_scale;
                 write_color(std::cout, pixel_color);
@@ -73,33 +125,195 @@ class Camera {
     vec3   pixel00_loc;
     
     double pixel_sample_scale;
+    double differential_scale;  // Of the camera ray differentials, in pixels
     vec3   u, v, w;     
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radius
     const Hittable* ray_world;
-    vector<vector<color>> mt_tex;
-    ThreadPool threadPool;
-
-    void mt_render_row(int i) {
-        vector<color> row;
-        for (int j = 0; j < image_width; j++) {
-            color pixel_color(0, 0, 0);
-            for (int samp = 0; samp < samples_per_pixel; ++samp) {
-                Ray r = get_ray(j, i);
-                pixel_color += ray_color(r, max_depth, *ray_world);
+    const CompiledScene* packet_scene; // Set when world supports packet tracing
+    LightBVH scene_lights;     // Picked by importance at each shading point for next event estimation
+    vector<color> mt_tex;      // Shared framebuffer, row major. Tiles never overlap so workers write without locking
+    TileScheduler tileScheduler;
+    std::atomic<long long> samples_taken{0};
+
+    // Running mean of a pixel's samples, plus Welford's sum of squared deviations of their luminance
+    struct PixelStats {
+        color mean = color(0, 0, 0);
+        double lumMean = 0;
+        double lumM2 = 0;
+        int count = 0;
+
+        void add(const color& sample) {
+            ++count;
+            mean += (sample - mean) / count;
+            double lum = luminance(sample);
+            double delta = lum - lumMean;
+            lumMean += delta / count;
+            lumM2 += delta * (lum - lumMean);
+        }
+
+        // Standard error of the mean luminance
+        double error() const {
+            return count < 2 ? infinity : std::sqrt(lumM2 / (count - 1) / count);
+        }
+    };
+
+    void mt_render_tiles(int worker) {
+        if (adaptive_sampling) {
+            mt_render_tiles_adaptive(worker);
+            return;
+        }
+        if (packet_scene) {
+            switch (packet_size) {
+                case 4:  mt_render_tile_packets<4>(worker);  return;
+                case 8:  mt_render_tile_packets<8>(worker);  return;
+                case 16: mt_render_tile_packets<16>(worker); return;
+            }
+        }
+
+        auto sampler = makeSampler(sampler_type, samples_per_pixel, seed);
+        Tile tile;
+        while (tileScheduler.next(worker, tile)) {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                color* row = &mt_tex[size_t(j) * image_width];
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    color pixel_color(0, 0, 0);
+                    for (int samp = 0; samp < samples_per_pixel; ++samp) {
+                        Ray r = get_ray(i, j, samp, *sampler);
+                        pixel_color += ray_color(r, max_depth, *ray_world, *sampler);
+                    }
+                    row[i] = pixel_color * pixel_sample_scale;
+                }
             }
-            pixel_color *= pixel_sample_scale;
-            row.push_back(pixel_color);
         }
-        mt_tex[i] = row;
     }
     
+    /*
+        Every pixel of a tile gets adaptive_min_samples, then the tile goes round in passes of adaptive_batch
+        samples over the pixels that still need work. A pixel keeps going while any pixel in its 3x3
+        neighbourhood is above the error threshold. A lone pixel whose first samples all happened to miss a
+        rare bright path would otherwise stop early and stay dark.
+    */
+    void mt_render_tiles_adaptive(int worker) {
+        const int first_batch = std::max(2, std::min(adaptive_min_samples, samples_per_pixel));
+        const int batch = std::max(1, adaptive_batch);
+        long long taken = 0;
+
+        auto sampler = makeSampler(sampler_type, samples_per_pixel, seed);
+        std::vector<PixelStats> stats;
+        std::vector<char> noisy, sampling;
+        Tile tile;
+        while (tileScheduler.next(worker, tile)) {
+            int tw = tile.x1 - tile.x0, th = tile.y1 - tile.y0;
+            stats.assign(size_t(tw) * th, PixelStats());
+            noisy.assign(stats.size(), 0);
+            sampling.assign(stats.size(), 1);
+
+            bool active = true;
+            for (int target = first_batch; active; target += batch) {
+                for (int j = 0; j < th; j++) {
+                    for (int i = 0; i < tw; i++) {
+                        PixelStats& s = stats[size_t(j) * tw + i];
+                        if (!sampling[size_t(j) * tw + i])
+                            continue;
+                        while (s.count < std::min(target, samples_per_pixel)) {
+                            Ray r = get_ray(tile.x0 + i, tile.y0 + j, s.count, *sampler);
+                            s.add(ray_color(r, max_depth, *ray_world, *sampler));
+                        }
+                    }
+                }
+
+                for (size_t p = 0; p < stats.size(); ++p) {
+                    const PixelStats& s = stats[p];
+                    noisy[p] = s.error() > adaptive_threshold * std::max(s.lumMean, 0.1);
+                }
+
+                active = false;
+                for (int j = 0; j < th; j++) {
+                    for (int i = 0; i < tw; i++) {
+                        bool keep = false;
+                        for (int nj = std::max(0, j - 1); nj <= std::min(th - 1, j + 1); nj++)
+                            for (int ni = std::max(0, i - 1); ni <= std::min(tw - 1, i + 1); ni++)
+                                keep = keep || noisy[size_t(nj) * tw + ni];
+
+                        size_t p = size_t(j) * tw + i;
+                        sampling[p] = keep && stats[p].count < samples_per_pixel;
+                        active = active || sampling[p];
+                    }
+                }
+            }
+
+            for (int j = 0; j < th; j++) {
+                for (int i = 0; i < tw; i++) {
+                    const PixelStats& s = stats[size_t(j) * tw + i];
+                    mt_tex[size_t(tile.y0 + j) * image_width + tile.x0 + i] = s.mean;
+                    taken += s.count;
+                }
+            }
+        }
+        samples_taken += taken;
+    }
+
+    // Walks each tile in small pixel blocks (2x2, 4x2 or 4x4) and traces one packet per block and sample.
+    // Only the primary hit is found together, every bounce after it is traced alone.
+    template<int N>
+    void mt_render_tile_packets(int worker) {
+        const int block_w = N == 4 ? 2 : 4;
+        const int block_h = N / block_w;
+
+        Ray rays[N];
+        Hit_Record recs[N];
+        color sums[N];
+        int px[N], py[N];
+
+        auto sampler = makeSampler(sampler_type, samples_per_pixel, seed);
+        Tile tile;
+        while (tileScheduler.next(worker, tile)) {
+            for (int by = tile.y0; by < tile.y1; by += block_h) {
+                for (int bx = tile.x0; bx < tile.x1; bx += block_w) {
+                    int count = 0;
+                    for (int j = by; j < std::min(by + block_h, tile.y1); j++) {
+                        for (int i = bx; i < std::min(bx + block_w, tile.x1); i++) {
+                            px[count] = i;
+                            py[count] = j;
+                            sums[count] = color(0, 0, 0);
+                            ++count;
+                        }
+                    }
+
+                    for (int samp = 0; samp < samples_per_pixel; ++samp) {
+                        for (int k = 0; k < count; ++k)
+                            rays[k] = get_ray(px[k], py[k], samp, *sampler);
+
+                        uint32_t hits = packet_scene->hitPacket<N>(rays, count, Interval(0.001, infinity), recs);
+                        for (int k = 0; k < count; ++k) {
+                            if (max_depth <= 0)
+                                continue;
+                            if (hits >> k & 1u) {
+                                sampler->startPixelSample(px[k], py[k], samp, CAMERA_DIMENSIONS);
+                                sums[k] += shade(rays[k], recs[k], max_depth, *ray_world, *sampler);
+                            }
+                            else
+                                sums[k] += background_color;
+                        }
+                    }
+
+                    for (int k = 0; k < count; ++k)
+                        mt_tex[size_t(py[k]) * image_width + px[k]] = sums[k] * pixel_sample_scale;
+                }
+            }
+        }
+    }
+
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
         pixel_sample_scale = 1.0 / samples_per_pixel;
 
+        // With many samples per pixel each one only needs to cover its share of the pixel, as pbrt does
+        differential_scale = std::max(0.125, 1.0 / std::sqrt(double(samples_per_pixel)));
+
         center = lookfrom;
 
         // Determine viewport dimensions.
@@ -130,21 +344,48 @@ class Camera {
         defocus_disk_v = v * defocus_radius;
     }
 
-    Ray get_ray(int i, int j) {
-        vec3 offset = sample_square();
+    // Sampler dimensions: pixel offset (2), lens (2) and time (1) first, then one fixed block per bounce so
+    // the same dimension always drives the same decision
+    static constexpr int CAMERA_DIMENSIONS = 5;
+    static constexpr int BOUNCE_DIMENSIONS = 7;   // Material 2D, material 1D, roulette, light choice, light 2D
+    static constexpr int ROULETTE_DIMENSION = 3;  // Within a bounce block
+    static constexpr int LIGHT_DIMENSION = 4;
+
+    static int bounceDimension(int bounces) {
+        return CAMERA_DIMENSIONS + (bounces - 1) * BOUNCE_DIMENSIONS;
+    }
+
+    // Starts sample samp of pixel (i, j) on the sampler and builds its camera ray
+    Ray get_ray(int i, int j, int samp, Sampler& sampler) const {
+        sampler.startPixelSample(i, j, samp);
+        vec3 offset = sample_square(sampler.get2D());
         vec3 sameple_pos = pixel00_loc + (i + offset.x()) * pixel_delta_u + (j + offset.y()) * pixel_delta_v;
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        Sample2D lens = sampler.get2D();
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(lens);
         vec3 ray_direction = sameple_pos - ray_origin;
-        double ray_time = random_double();
+        double ray_time = sampler.get1D();
 
         return Ray(ray_origin, ray_direction, ray_time);
     }
 
-    vec3 sample_square() {
-        return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    // Differential of a camera ray from get_ray(): the same lens point, aimed one (scaled) pixel step over
+    Ray_Differential camera_differential(const Ray& r) const {
+        Ray_Differential rd;
+        if (!ray_differentials)
+            return rd;
+
+        rd.rxOrigin = rd.ryOrigin = r.origin();
+        rd.rxDirection = r.direction() + differential_scale * pixel_delta_u;
+        rd.ryDirection = r.direction() + differential_scale * pixel_delta_v;
+        rd.valid = true;
+        return rd;
+    }
+
+    static vec3 sample_square(const Sample2D& u) {
+        return vec3(u.x - 0.5, u.y - 0.5, 0);
     }
 
-    color ray_color(const Ray& r,  int depth, const Hittable& world) {
+    color ray_color(const Ray& r,  int depth, const Hittable& world, Sampler& sampler) {
         if (depth <= 0) {
             return vec3(0, 0, 0);
         }
@@ -152,20 +393,377 @@ class Camera {
         Hit_Record record;
         if (!world.hit(r, Interval(0.001, infinity), record))
             return background_color;
-        
-        color att;
-        Ray scatter;
-        color emission_color = record.mat->emitted(record.u, record.v, record.p);
-        if (!record.mat->scatter(r, record, att, scatter)) 
-            return emission_color;
 
-        return att * ray_color(scatter, depth - 1, world) + emission_color;
+        return shade(r, record, depth, world, sampler);
+    }
+
+    // Follows the path on from its first hit, shared by the single ray and packet paths. The path is walked in
+    // a loop with its throughput tracked explicitly, which sums the same terms the recursive form did.
+    color shade(const Ray& r, Hit_Record& record, int depth, const Hittable& world, Sampler& sampler) {
+        color radiance(0, 0, 0);
+        color throughput(1, 1, 1);
+        Ray ray = r;
+        double scatter_pdf = 0;  // Of the scatter that made ray, 0 for the camera ray and specular bounces
+        vec3 scatter_normal;     // light_normal() where that scatter happened
+        Ray_Differential differential = camera_differential(r);
+
+        for (int bounces = 1; ; ++bounces) {
+            record.object->evaluate(ray, record);
+            record.compute_differentials(differential);
+
+            Scatter_Record srec;
+            color emission_color;
+            sampler.setDimension(bounceDimension(bounces));
+            bool scatters = bounce(ray, record, emission_color, srec, sampler);
+            if (!is_black(emission_color))
+                radiance += throughput * emission_color * emission_weight(ray, record.t, scatter_pdf, scatter_normal);
+            if (!scatters || bounces >= depth)
+                break;
+
+            if (!record.mat->isSpecular()) {
+                sampler.setDimension(bounceDimension(bounces) + LIGHT_DIMENSION);
+                radiance += throughput * direct_light(ray, record, world, sampler);
+            }
+            scatter_pdf = srec.is_specular ? 0 : srec.pdf;
+            scatter_normal = light_normal(record);
+
+            throughput = throughput * srec.attenuation;
+            if (!survives_roulette(throughput, bounces, sampler))
+                break;
+
+            differential = scattered_differential(ray, differential, record, srec);
+            ray = srec.scattered;
+            if (!world.hit(ray, Interval(0.001, infinity), record)) {
+                radiance += throughput * background_color;
+                break;
+            }
+        }
+
+        return radiance;
+    }
+
+    // Russian roulette after rr_min_depth bounces: the path goes on with probability equal to its largest
+    // throughput channel (at most 1) and is reweighted by 1/p when it does, which keeps the estimate unbiased.
+    bool survives_roulette(color& throughput, int bounces, Sampler& sampler) {
+        if (rr_min_depth < 0 || bounces < rr_min_depth)
+            return true;
+
+        double p = std::min(1.0, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+        sampler.setDimension(bounceDimension(bounces) + ROULETTE_DIMENSION);
+        if (p <= 0 || sampler.get1D() >= p)
+            return false;
+        throughput = throughput / p;
+        return true;
+    }
+
+    // One interaction at an evaluated hit: the emitted light, and when the material scatters, the sampled
+    // and next ray. The recursive and wavefront integrators both go through here.
+    bool bounce(const Ray& r, const Hit_Record& record, color& emission, Scatter_Record& srec, Sampler& sampler) {
+        emission = record.mat->emitted(record.u, record.v, record.p);
+        return record.mat->sample(r, record, sampler, srec);
+    }
+
+    // Differential of srec.scattered, invalid after bounces that lose the footprint
+    static Ray_Differential scattered_differential(const Ray& r, const Ray_Differential& rd, const Hit_Record& record,
+                                                   const Scatter_Record& srec) {
+        Ray_Differential next;
+        if (rd.valid)
+            record.mat->scatterDifferential(r, rd, record, srec, next);
+        return next;
+    }
+
+    static bool is_black(const color& c) {
+        return c.x() <= 0 && c.y() <= 0 && c.z() <= 0;
+    }
+
+    // Normal the light BVH weighs lights against at a shading point, none inside media
+    static vec3 light_normal(const Hit_Record& record) {
+        return record.mat->isVolumetric() ? vec3(0, 0, 0) : record.normal;
+    }
+
+    // Density of light sampling producing the direction of r from a point with light_normal() n, counting the
+    // lights it reaches up to t_hit. Lights hidden behind the first one could never pass their shadow test
+    // along r, so they do not count.
+    double light_pdf(const Ray& r, double t_hit, const vec3& n) const {
+        return scene_lights.pdf(r, Interval(0.001, t_hit * (1 + 1e-6)), n);
+    }
+
+    // Power heuristic weight for emission a scattered ray found at t_hit. Light sampling covers the same
+    // directions, unless the scatter was specular (scatter_pdf 0) or there are no lights to sample.
+    double emission_weight(const Ray& r, double t_hit, double scatter_pdf, const vec3& scatter_normal) const {
+        if (scatter_pdf <= 0)
+            return 1;
+        double lp = light_pdf(r, t_hit, scatter_normal);
+        return scatter_pdf * scatter_pdf / (scatter_pdf * scatter_pdf + lp * lp);
+    }
+
+    /*
+        Next event estimation: a light chosen by the light BVH, a point on it, and a shadow ray that finds the
+        transmittance up to just short of it. It is weighted against the chance that scattering would have picked the same
+        direction (power heuristic), the matching half of emission_weight(). The cheap tests go first, the
+        shadow ray last. The pick probability needs no separate factor, light_pdf() already includes it.
+    */
+    color direct_light(const Ray& r_in, const Hit_Record& record, const Hittable& world, Sampler& sampler) {
+        vec3 n = light_normal(record);
+        double pmf;
+        const Hittable* picked = scene_lights.sample(record.p, n, sampler.get1D(), pmf);
+        if (!picked)
+            return color(0, 0, 0);
+
+        const Hittable& light = *picked;
+        vec3 to_light = light.sampleDirection(record.p, r_in.time(), sampler.get2D());
+        Ray shadow(record.p, to_light, r_in.time());
+
+        color f = record.mat->eval(r_in, record, to_light);
+        if (is_black(f))
+            return color(0, 0, 0);
+
+        // The sampled point sits at t = 1. Hitting the light there gives its u, v for textured emission
+        Hit_Record light_rec;
+        if (!light.hit(shadow, Interval(0.001, 1 + 1e-6), light_rec))
+            return color(0, 0, 0);
+        double lp = light_pdf(shadow, light_rec.t, n);
+        if (lp <= 0)
+            return color(0, 0, 0);
+        light_rec.object->evaluate(shadow, light_rec);
+        color emitted = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+        if (is_black(emitted))
+            return color(0, 0, 0);
+
+        // Media along the way let a fraction through rather than blocking or not
+        double transmittance = world.transmittance(shadow, Interval(0.001, light_rec.t * (1 - 1e-6)));
+        if (transmittance <= 0)
+            return color(0, 0, 0);
+
+        double sp = record.mat->pdf(r_in, record, to_light);
+        double weight = lp * lp / (lp * lp + sp * sp);
+        return f * emitted * (transmittance * weight / lp);
+    }
+
+    struct PathState {
+        Ray ray;
+        color throughput;
+        color radiance;
+        uint32_t pixel;
+        uint32_t sample; // Index of this path among its pixel's samples
+        int depth;      // Bounces left, same meaning as ray_color's depth
+        double scatter_pdf; // Density of the scatter that made ray, 0 for camera rays and specular bounces
+        vec3 scatter_normal; // light_normal() where that scatter happened
+        Ray_Differential differential;
+    };
+
+    struct PathKey {
+        uint64_t code;
+        uint32_t index;
+    };
+
+    /*
+        Wavefront integrator. Instead of following one path to the end, a batch of paths moves through each
+        stage together: generate, intersect, sort the hits by material class and direction, shade, compact.
+        Every stage is a parallelFor over the batch. Sorting means the shade stage runs long stretches of the
+        same sample() code, and the surviving rays are sorted by direction octant and origin cell before the next
+        intersect so neighbouring rays walk the same part of the BVH.
+
+        Compaction counts survivors per chunk, prefix sums the counts and has each chunk scatter its own, so
+        the order does not depend on the thread count. Finished paths leave their radiance in a slot of their
+        own, which a last pass over the pixels adds up in sample order.
+
+        Paths only add up products of attenuation and emission, so the result matches ray_color and the tile
+        renderer exactly.
+    */
+    void render_wavefront(ThreadPool& pool) {
+        const size_t CHUNK = 1024;
+        auto chunked = [&](size_t n, const std::function<void(size_t, size_t)>& fn) {
+            pool.parallelFor(int((n + CHUNK - 1) / CHUNK), [&](int c) {
+                fn(size_t(c) * CHUNK, std::min(n, size_t(c + 1) * CHUNK));
+            });
+        };
+
+        // Turns per chunk survivor counts into each chunk's first output index, returns the total
+        std::vector<size_t> chunkOffsets;
+        auto prefixSum = [&]() {
+            size_t sum = 0;
+            for (size_t& offset : chunkOffsets) {
+                size_t count = offset;
+                offset = sum;
+                sum += count;
+            }
+            return sum;
+        };
+
+        const size_t pixels = size_t(image_width) * image_height;
+        const size_t total = pixels * samples_per_pixel;
+        std::vector<color> sums(pixels, color(0, 0, 0));
+        if (max_depth <= 0)
+            return;
+
+        AABB sceneBounds = ray_world->getBoundingBox();
+        std::vector<PathState> paths, shaded;
+        std::vector<Hit_Record> recs;
+        std::vector<char> alive;
+        std::vector<PathKey> keys;
+        std::vector<color> finished;  // Radiance of each path of the batch, by its index at generation
+
+        for (size_t first = 0; first < total; first += size_t(wavefront_batch)) {
+            // Generate. Consecutive paths are neighbouring pixels of the same sample pass
+            size_t count = std::min(size_t(wavefront_batch), total - first);
+            paths.resize(count);
+            finished.resize(count);
+            auto slot = [&](const PathState& path) { return size_t(path.sample) * pixels + path.pixel - first; };
+            chunked(count, [&](size_t from, size_t to) {
+                auto sampler = makeSampler(sampler_type, samples_per_pixel, seed);
+                for (size_t i = from; i < to; ++i) {
+                    uint32_t pixel = uint32_t((first + i) % pixels);
+                    uint32_t sample = uint32_t((first + i) / pixels);
+                    Ray r = get_ray(int(pixel % image_width), int(pixel / image_width), int(sample), *sampler);
+                    paths[i] = PathState{ r, color(1, 1, 1), color(0, 0, 0), pixel, sample, max_depth, 0, vec3(),
+                                          camera_differential(r) };
+                }
+            });
+
+            while (!paths.empty()) {
+                size_t n = paths.size();
+
+                // Intersect, and evaluate the closest hit so its material is known for sorting. Misses pick up
+                // the background and finish.
+                recs.resize(n);
+                alive.resize(n);
+                chunkOffsets.assign((n + CHUNK - 1) / CHUNK, 0);
+                chunked(n, [&](size_t from, size_t to) {
+                    size_t hits = 0;
+                    for (size_t i = from; i < to; ++i) {
+                        alive[i] = ray_world->hit(paths[i].ray, Interval(0.001, infinity), recs[i]);
+                        if (alive[i]) {
+                            recs[i].object->evaluate(paths[i].ray, recs[i]);
+                            recs[i].compute_differentials(paths[i].differential);
+                            ++hits;
+                        } else {
+                            finished[slot(paths[i])] = paths[i].radiance + paths[i].throughput * background_color;
+                        }
+                    }
+                    chunkOffsets[from / CHUNK] = hits;
+                });
+
+                // Hits get sorted by material class then direction octant. The sort is stable, so within a
+                // bucket paths stay in pixel order.
+                keys.resize(prefixSum());
+                chunked(n, [&](size_t from, size_t to) {
+                    size_t out = chunkOffsets[from / CHUNK];
+                    for (size_t i = from; i < to; ++i) {
+                        if (!alive[i])
+                            continue;
+                        uint64_t type = uint64_t(recs[i].mat->type());
+                        keys[out++] = PathKey{ (type << 3) | directionOctant(paths[i].ray.direction()), uint32_t(i) };
+                    }
+                });
+                parallelRadixSort(keys, pool, 3 + 8 * sizeof(Material_Type));
+
+                // Shade in sorted order
+                size_t live = keys.size();
+                shaded.resize(live);
+                alive.assign(live, 0);
+                chunkOffsets.assign((live + CHUNK - 1) / CHUNK, 0);
+                chunked(live, [&](size_t from, size_t to) {
+                    auto sampler = makeSampler(sampler_type, samples_per_pixel, seed);
+                    size_t survivors = 0;
+                    for (size_t j = from; j < to; ++j) {
+                        uint32_t i = keys[j].index;
+                        PathState path = paths[i];
+                        int bounces = max_depth - path.depth + 1;
+                        sampler->startPixelSample(int(path.pixel % image_width), int(path.pixel / image_width),
+                                                  int(path.sample), bounceDimension(bounces));
+                        color emission;
+                        Scatter_Record srec;
+                        bool scatters = bounce(path.ray, recs[i], emission, srec, *sampler);
+                        if (!is_black(emission))
+                            path.radiance += path.throughput * emission *
+                                             emission_weight(path.ray, recs[i].t, path.scatter_pdf, path.scatter_normal);
+                        if (scatters && path.depth > 1) {
+                            // The shadow ray is traced right here rather than as a wave of its own
+                            if (!recs[i].mat->isSpecular()) {
+                                sampler->setDimension(bounceDimension(bounces) + LIGHT_DIMENSION);
+                                path.radiance += path.throughput * direct_light(path.ray, recs[i], *ray_world, *sampler);
+                            }
+                            path.scatter_pdf = srec.is_specular ? 0 : srec.pdf;
+                            path.scatter_normal = light_normal(recs[i]);
+                            path.throughput = path.throughput * srec.attenuation;
+                            if (survives_roulette(path.throughput, bounces, *sampler)) {
+                                path.differential = scattered_differential(path.ray, path.differential, recs[i], srec);
+                                path.ray = srec.scattered;
+                                --path.depth;
+                                alive[j] = 1;
+                            }
+                        }
+                        if (alive[j])
+                            ++survivors;
+                        else
+                            finished[slot(path)] = path.radiance;
+                        shaded[j] = path;
+                    }
+                    chunkOffsets[from / CHUNK] = survivors;
+                });
+
+                // Compact
+                paths.resize(prefixSum());
+                chunked(live, [&](size_t from, size_t to) {
+                    size_t out = chunkOffsets[from / CHUNK];
+                    for (size_t j = from; j < to; ++j) {
+                        if (alive[j])
+                            paths[out++] = shaded[j];
+                    }
+                });
+
+                // Sort the next wave of rays by direction octant, then by the cell their origin falls in
+                keys.resize(paths.size());
+                chunked(paths.size(), [&](size_t from, size_t to) {
+                    for (size_t i = from; i < to; ++i) {
+                        keys[i] = PathKey{ (uint64_t(directionOctant(paths[i].ray.direction())) << 30) |
+                                           originCell(paths[i].ray.origin(), sceneBounds), uint32_t(i) };
+                    }
+                });
+                parallelRadixSort(keys, pool, 33);
+                shaded.resize(paths.size());
+                chunked(paths.size(), [&](size_t from, size_t to) {
+                    for (size_t i = from; i < to; ++i)
+                        shaded[i] = paths[keys[i].index];
+                });
+                paths.swap(shaded);
+            }
+
+            // Hand the batch to its pixels, each pixel adding its samples in order
+            chunked(pixels, [&](size_t from, size_t to) {
+                for (size_t p = from; p < to; ++p) {
+                    for (size_t i = (p + pixels - first % pixels) % pixels; i < count; i += pixels)
+                        sums[p] += finished[i];
+                }
+            });
+        }
+
+        for (size_t p = 0; p < pixels; ++p)
+            mt_tex[p] = sums[p] * pixel_sample_scale;
+    }
+
+    static uint32_t directionOctant(const vec3& d) {
+        return uint32_t(d[0] < 0) | uint32_t(d[1] < 0) << 1 | uint32_t(d[2] < 0) << 2;
+    }
+
+    // 30 bit Morton code of the origin on a 1024^3 grid over the scene bounds
+    static uint64_t originCell(const point3& p, const AABB& bounds) {
+        uint64_t code = 0;
+        for (int a = 0; a < 3; ++a) {
+            double extent = bounds.m_boxMax[a] - bounds.m_boxMin[a];
+            double f = std::isfinite(extent) && extent > 0 ? (p[a] - bounds.m_boxMin[a]) / extent : 0;
+            uint64_t q = uint64_t(std::clamp(f, 0.0, 1.0) * 1023.0);
+            for (int bit = 0; bit < 10; ++bit)
+                code |= ((q >> bit) & 1) << (3 * bit + a);
+        }
+        return code;
     }
 
 
-    point3 defocus_disk_sample() const {
-        // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
+    point3 defocus_disk_sample(const Sample2D& u) const {
+        // Returns a point in the camera defocus disk.
+        auto p = sample_unit_disk(u.x, u.y);
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 };
@@ -18,6 +18,11 @@ using color = vec3;
     return 0;
  }
 
+// Rec. 709 luminance of a linear color
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 void write_color(ostream& out, const color& pixel_color) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
@@ -0,0 +1,621 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "utilities.h"
+#include "hittable_list.h"
+#include "bvh_builder.h"
+#include "bvh_node.h"
+#include "wide_bvh.h"
+#include "sphere.h"
+#include "quad.h"
+#include "box.h"
+#include "constant_media.h"
+#include "material.h"
+#include "ray_packet.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+enum class PrimType : uint8_t { Sphere, MovingSphere, Quad, Box, Medium, Generic };
+
+// Which array a BVH leaf entry lives in, and where
+struct PrimRef {
+    PrimType type;
+    uint32_t index;
+};
+
+// One vec3 per primitive, stored as three separate arrays
+struct Vec3Array {
+    std::vector<double> x, y, z;
+
+    void push_back(const vec3& v) {
+        x.push_back(v[0]);
+        y.push_back(v[1]);
+        z.push_back(v[2]);
+    }
+
+    vec3 operator[](size_t i) const {
+        return vec3(x[i], y[i], z[i]);
+    }
+};
+
+/*
+    Render time form of a Hittable_List. Authoring keeps using Sphere, Quad, etc. Compiling flattens nested
+    lists and BVHs, copies each known primitive type into its own SoA arrays (laid out in BVH leaf order) and
+    builds one BVH over everything. Traversal switches on the primitive tag and calls the primitives' static
+    kernels directly, so no virtual call happens until a leaf holds something the compiler doesn't know
+    (Transforms, instances...), which stays a Generic entry.
+
+    Materials go into an integer indexed table. They still shade through their own virtual sample().
+
+    With a wide BVHLayout the binary tree is also collapsed into a WideBVHTree, which hit(), occluded() and
+    transmittance() walk instead. Packets keep to the binary tree.
+*/
+class CompiledScene : public Hittable {
+    public:
+        CompiledScene(const Hittable_List& world, int max_leaf_size = 4, BVHBuildMethod method = BVHBuildMethod::SAH,
+                      BVHLayout layout = BVHLayout::Binary)
+            : m_layout(layout) {
+            std::vector<shared_ptr<Hittable>> objects;
+            for (const auto& obj : world.objects)
+                gather(obj, objects);
+
+            std::vector<AABB> primBounds(objects.size());
+            m_aabb = AABB::empty;
+            for (size_t idx = 0; idx < objects.size(); ++idx) {
+                primBounds[idx] = objects[idx]->getBoundingBox();
+                m_aabb = AABB(m_aabb, primBounds[idx]);
+            }
+
+            std::vector<uint32_t> primOrder;
+            buildBVH(method, max_leaf_size, primBounds, m_nodes, primOrder);
+            if (m_layout == BVHLayout::Wide4)
+                m_wide4 = WideBVHTree<4>(m_nodes);
+            else if (m_layout == BVHLayout::Wide8)
+                m_wide8 = WideBVHTree<8>(m_nodes);
+
+            m_refs.reserve(primOrder.size());
+            for (uint32_t idx : primOrder)
+                m_refs.push_back(append(objects[idx]));
+
+            // Lights are sampled through the authored objects, which are kept alive here for that
+            for (const auto& obj : objects) {
+                size_t before = m_lights.size();
+                obj->gatherLights(m_lights);
+                if (m_lights.size() != before)
+                    m_lightSources.push_back(obj);
+            }
+        }
+
+        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            if (m_nodes.empty())
+                return false;
+
+            if (m_layout != BVHLayout::Binary) {
+                bool hit_anything = false;
+                double closest_so_far = ray_t.max;
+                withWideTree([&](const auto& tree) {
+                    tree.traverseNearest(r, ray_t.min, closest_so_far, [&](uint32_t first, uint32_t count) {
+                        for (uint32_t i = first; i < first + count; ++i) {
+                            if (hitPrimitive(i, r, Interval(ray_t.min, closest_so_far), rec)) {
+                                hit_anything = true;
+                                closest_so_far = rec.t;
+                            }
+                        }
+                    });
+                });
+                return hit_anything;
+            }
+
+            const point3& orig = r.origin();
+            const vec3& invDir = r.inv_direction();
+            bool dirIsNeg[3] = { invDir[0] < 0, invDir[1] < 0, invDir[2] < 0 };
+
+            bool hit_anything = false;
+            double closest_so_far = ray_t.max;
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                if (node.hit(orig, invDir, ray_t.min, closest_so_far)) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i) {
+                            if (hitPrimitive(node.primitivesOffset + i, r, Interval(ray_t.min, closest_so_far), rec)) {
+                                hit_anything = true;
+                                closest_so_far = rec.t;
+                            }
+                        }
+                        if (toVisitCount == 0)
+                            break;
+                        current = toVisit[--toVisitCount];
+                    } else if (dirIsNeg[node.axis]) {
+                        toVisit[toVisitCount++] = current + 1;
+                        current = node.secondChildOffset;
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                    }
+                } else {
+                    if (toVisitCount == 0)
+                        break;
+                    current = toVisit[--toVisitCount];
+                }
+            }
+
+            return hit_anything;
+        }
+
+        // Any hit ends the walk, so children are pushed in storage order without working out the near one
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            if (m_nodes.empty())
+                return false;
+
+            if (m_layout != BVHLayout::Binary) {
+                return withWideTree([&](const auto& tree) {
+                    return tree.traverseAny(r, ray_t.min, ray_t.max, [&](uint32_t first, uint32_t count) {
+                        for (uint32_t i = first; i < first + count; ++i)
+                            if (occludedPrimitive(i, r, ray_t))
+                                return true;
+                        return false;
+                    });
+                });
+            }
+
+            const point3& orig = r.origin();
+            const vec3& invDir = r.inv_direction();
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                if (node.hit(orig, invDir, ray_t.min, ray_t.max)) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i)
+                            if (occludedPrimitive(node.primitivesOffset + i, r, ray_t))
+                                return true;
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                        continue;
+                    }
+                }
+                if (toVisitCount == 0)
+                    return false;
+                current = toVisit[--toVisitCount];
+            }
+        }
+
+        // Same walk as occluded(), multiplying up what each primitive lets through until something opaque
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            if (m_nodes.empty())
+                return 1;
+
+            if (m_layout != BVHLayout::Binary) {
+                double T = 1;
+                withWideTree([&](const auto& tree) {
+                    tree.traverseAny(r, ray_t.min, ray_t.max, [&](uint32_t first, uint32_t count) {
+                        for (uint32_t i = first; i < first + count; ++i) {
+                            T *= transmittancePrimitive(i, r, ray_t);
+                            if (T <= 0)
+                                return true;
+                        }
+                        return false;
+                    });
+                });
+                return T <= 0 ? 0 : T;
+            }
+
+            const point3& orig = r.origin();
+            const vec3& invDir = r.inv_direction();
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            double T = 1;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                if (node.hit(orig, invDir, ray_t.min, ray_t.max)) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i) {
+                            T *= transmittancePrimitive(node.primitivesOffset + i, r, ray_t);
+                            if (T <= 0)
+                                return 0;
+                        }
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                        continue;
+                    }
+                }
+                if (toVisitCount == 0)
+                    return T;
+                current = toVisit[--toVisitCount];
+            }
+        }
+
+        /*
+            Traces count (<= N) coherent rays together and returns the mask of lanes that hit something, with
+            recs[k] filled the same way hit() would. Nodes are tested for all lanes at once and visited if any
+            lane overlaps them. Spheres and quads are intersected lane parallel, the other primitive types run
+            the scalar kernel for each lane that reached them.
+        */
+        template<int N>
+        uint32_t hitPacket(const Ray* rays, int count, const Interval& ray_t, Hit_Record* recs) const {
+            RayPacket<N> packet(rays, count, ray_t.max);
+            uint32_t hitMask = 0;
+            if (m_nodes.empty())
+                return hitMask;
+
+            uint32_t toVisit[BVH_MAX_DEPTH];
+            int toVisitCount = 0;
+            uint32_t current = 0;
+            while (true) {
+                const LinearBVHNode& node = m_nodes[current];
+                uint32_t mask = packet.hitNode(node, ray_t.min);
+                if (mask) {
+                    if (node.isLeaf()) {
+                        for (uint32_t i = 0; i < node.primitiveCount; ++i)
+                            hitMask |= hitPrimitivePacket(node.primitivesOffset + i, packet, mask, rays, ray_t.min, recs);
+                        if (toVisitCount == 0)
+                            break;
+                        current = toVisit[--toVisitCount];
+                    } else if (packet.dirIsNeg(firstLane(mask), node.axis)) {
+                        toVisit[toVisitCount++] = current + 1;
+                        current = node.secondChildOffset;
+                    } else {
+                        toVisit[toVisitCount++] = node.secondChildOffset;
+                        current = current + 1;
+                    }
+                } else {
+                    if (toVisitCount == 0)
+                        break;
+                    current = toVisit[--toVisitCount];
+                }
+            }
+
+            return hitMask;
+        }
+
+        void evaluate(const Ray& r, Hit_Record& rec) const override {
+            PrimRef ref = m_refs[rec.primitive];
+            uint32_t i = ref.index;
+            switch (ref.type) {
+                case PrimType::Sphere:
+                    Sphere::evaluateSurface(m_sphereCenter[i], m_sphereRadius[i], r, rec);
+                    rec.mat = m_materials[m_sphereMat[i]].get();
+                    break;
+                case PrimType::MovingSphere:
+                    Sphere::evaluateSurface(m_movingCenter0[i] + m_movingCenterVec[i] * r.time(), m_movingRadius[i], r, rec);
+                    rec.mat = m_materials[m_movingMat[i]].get();
+                    break;
+                case PrimType::Quad:
+                    rec.p = r.at(rec.t);
+                    rec.set_face_normal(r, m_quadNormal[i]);
+                    rec.set_partials(m_quadU[i], m_quadV[i]);
+                    rec.mat = m_materials[m_quadMat[i]].get();
+                    break;
+                case PrimType::Box:
+                    Box::evaluateSurface(m_boxMin[i], m_boxMax[i], r, rec);
+                    rec.mat = m_materials[m_boxMat[i]].get();
+                    break;
+                case PrimType::Medium:
+                    Constant_Medium::evaluateSurface(r, rec);
+                    rec.mat = m_materials[m_mediumMat[i]].get();
+                    break;
+                case PrimType::Generic:
+                    // Generic objects put themselves in rec.object, so evaluation never comes through here
+                    break;
+            }
+        }
+
+        AABB getBoundingBox() const override {
+            return m_aabb;
+        }
+
+        const std::vector<shared_ptr<Material>>& materials() const {
+            return m_materials;
+        }
+
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            lights.insert(lights.end(), m_lights.begin(), m_lights.end());
+        }
+
+    private:
+        // Runs walk on the wide tree the layout asked for
+        template<typename F>
+        auto withWideTree(F&& walk) const -> decltype(walk(std::declval<const WideBVHTree<4>&>())) {
+            return m_layout == BVHLayout::Wide8 ? walk(m_wide8) : walk(m_wide4);
+        }
+
+        // Flattens lists and BVHs into their leaves, everything else is compiled as is
+        static void gather(const shared_ptr<Hittable>& obj, std::vector<shared_ptr<Hittable>>& objects) {
+            if (auto list = std::dynamic_pointer_cast<Hittable_List>(obj)) {
+                for (const auto& child : list->objects)
+                    gather(child, objects);
+            } else if (auto bvh = std::dynamic_pointer_cast<BVH_Node>(obj)) {
+                for (const auto& child : bvh->primitives())
+                    gather(child, objects);
+            } else if (auto bvh4 = std::dynamic_pointer_cast<BVH4>(obj)) {
+                for (const auto& child : bvh4->primitives())
+                    gather(child, objects);
+            } else if (auto bvh8 = std::dynamic_pointer_cast<BVH8>(obj)) {
+                for (const auto& child : bvh8->primitives())
+                    gather(child, objects);
+            } else {
+                objects.push_back(obj);
+            }
+        }
+
+        PrimRef append(const shared_ptr<Hittable>& obj) {
+            if (auto sphere = dynamic_cast<const Sphere*>(obj.get())) {
+                if (sphere->m_isMoving) {
+                    m_movingCenter0.push_back(sphere->m_center0);
+                    m_movingCenterVec.push_back(sphere->m_centerVec);
+                    m_movingRadius.push_back(sphere->m_radius);
+                    m_movingMat.push_back(materialIndex(sphere->m_mat));
+                    return { PrimType::MovingSphere, uint32_t(m_movingRadius.size() - 1) };
+                }
+                m_sphereCenter.push_back(sphere->m_center0);
+                m_sphereRadius.push_back(sphere->m_radius);
+                m_sphereMat.push_back(materialIndex(sphere->m_mat));
+                return { PrimType::Sphere, uint32_t(m_sphereRadius.size() - 1) };
+            }
+            if (auto quad = dynamic_cast<const Quad*>(obj.get())) {
+                m_quadOrigin.push_back(quad->m_origin);
+                m_quadU.push_back(quad->m_u);
+                m_quadV.push_back(quad->m_v);
+                m_quadNormal.push_back(quad->m_normal);
+                m_quadW.push_back(quad->m_w);
+                m_quadD.push_back(quad->m_D);
+                m_quadMat.push_back(materialIndex(quad->m_mat));
+                return { PrimType::Quad, uint32_t(m_quadD.size() - 1) };
+            }
+            if (auto box = dynamic_cast<const Box*>(obj.get())) {
+                m_boxMin.push_back(box->m_boxMin);
+                m_boxMax.push_back(box->m_boxMax);
+                m_boxMat.push_back(materialIndex(box->m_mat));
+                return { PrimType::Box, uint32_t(m_boxMat.size() - 1) };
+            }
+            if (auto medium = dynamic_cast<const Constant_Medium*>(obj.get())) {
+                m_mediumBoundary.push_back(medium->m_boundary);
+                m_mediumNegInvDensity.push_back(medium->m_negInvDensity);
+                m_mediumMat.push_back(materialIndex(medium->m_phaseFunction));
+                return { PrimType::Medium, uint32_t(m_mediumMat.size() - 1) };
+            }
+            m_generic.push_back(obj);
+            return { PrimType::Generic, uint32_t(m_generic.size() - 1) };
+        }
+
+        uint32_t materialIndex(const shared_ptr<Material>& mat) {
+            auto found = m_materialIds.find(mat.get());
+            if (found != m_materialIds.end())
+                return found->second;
+
+            uint32_t id = uint32_t(m_materials.size());
+            m_materials.push_back(mat);
+            m_materialIds.emplace(mat.get(), id);
+            return id;
+        }
+
+        bool hitPrimitive(uint32_t refIdx, const Ray& r, const Interval& ray_t, Hit_Record& rec) const {
+            PrimRef ref = m_refs[refIdx];
+            uint32_t i = ref.index;
+            bool hit = false;
+            switch (ref.type) {
+                case PrimType::Sphere:
+                    hit = Sphere::intersect(m_sphereCenter[i], m_sphereRadius[i], r, ray_t, rec.t);
+                    break;
+                case PrimType::MovingSphere:
+                    hit = Sphere::intersect(m_movingCenter0[i] + m_movingCenterVec[i] * r.time(), m_movingRadius[i], r, ray_t, rec.t);
+                    break;
+                case PrimType::Quad:
+                    hit = Quad::intersect(m_quadOrigin[i], m_quadU[i], m_quadV[i], m_quadNormal[i], m_quadW[i], m_quadD[i],
+                                          r, ray_t, rec);
+                    break;
+                case PrimType::Box:
+                    hit = Box::intersect(m_boxMin[i], m_boxMax[i], r, ray_t, rec.t);
+                    break;
+                case PrimType::Medium:
+                    hit = Constant_Medium::intersect(*m_mediumBoundary[i], m_mediumNegInvDensity[i], r, ray_t, rec.t);
+                    break;
+                case PrimType::Generic:
+                    // Sets rec.object to itself, so evaluate() goes straight to it
+                    return m_generic[i]->hit(r, ray_t, rec);
+            }
+
+            if (hit) {
+                rec.object = this;
+                rec.primitive = refIdx;
+            }
+            return hit;
+        }
+
+        bool occludedPrimitive(uint32_t refIdx, const Ray& r, const Interval& ray_t) const {
+            PrimRef ref = m_refs[refIdx];
+            uint32_t i = ref.index;
+            double t;
+            switch (ref.type) {
+                case PrimType::Sphere:
+                    return Sphere::intersect(m_sphereCenter[i], m_sphereRadius[i], r, ray_t, t);
+                case PrimType::MovingSphere:
+                    return Sphere::intersect(m_movingCenter0[i] + m_movingCenterVec[i] * r.time(), m_movingRadius[i], r, ray_t, t);
+                case PrimType::Quad: {
+                    Hit_Record scratch;
+                    return Quad::intersect(m_quadOrigin[i], m_quadU[i], m_quadV[i], m_quadNormal[i], m_quadW[i], m_quadD[i],
+                                           r, ray_t, scratch);
+                }
+                case PrimType::Box:
+                    return Box::intersect(m_boxMin[i], m_boxMax[i], r, ray_t, t);
+                case PrimType::Medium:
+                    return Constant_Medium::intersect(*m_mediumBoundary[i], m_mediumNegInvDensity[i], r, ray_t, t);
+                case PrimType::Generic:
+                    return m_generic[i]->occluded(r, ray_t);
+            }
+            return false;
+        }
+
+        double transmittancePrimitive(uint32_t refIdx, const Ray& r, const Interval& ray_t) const {
+            PrimRef ref = m_refs[refIdx];
+            uint32_t i = ref.index;
+            switch (ref.type) {
+                case PrimType::Medium:
+                    return Constant_Medium::transmittance(*m_mediumBoundary[i], m_mediumNegInvDensity[i], r, ray_t);
+                case PrimType::Generic:
+                    return m_generic[i]->transmittance(r, ray_t);
+                default:
+                    return occludedPrimitive(refIdx, r, ray_t) ? 0 : 1;
+            }
+        }
+
+        static int firstLane(uint32_t mask) {
+            int lane = 0;
+            while (!(mask & 1u)) {
+                mask >>= 1;
+                ++lane;
+            }
+            return lane;
+        }
+
+        template<int N>
+        uint32_t hitPrimitivePacket(uint32_t refIdx, RayPacket<N>& packet, uint32_t mask, const Ray* rays, double tmin,
+                                    Hit_Record* recs) const {
+            PrimRef ref = m_refs[refIdx];
+            uint32_t i = ref.index;
+            double t[N], u[N], v[N];
+            uint32_t hits = 0;
+            switch (ref.type) {
+                case PrimType::Sphere:
+                    hits = intersectSpherePacket(packet, m_sphereCenter[i], vec3(0, 0, 0), m_sphereRadius[i], tmin, t);
+                    break;
+                case PrimType::MovingSphere:
+                    hits = intersectSpherePacket(packet, m_movingCenter0[i], m_movingCenterVec[i], m_movingRadius[i], tmin, t);
+                    break;
+                case PrimType::Quad:
+                    hits = intersectQuadPacket(packet, i, tmin, t, u, v);
+                    break;
+                default:
+                    for (int k = 0; k < N; ++k) {
+                        if ((mask >> k & 1u) && hitPrimitive(refIdx, rays[k], Interval(tmin, packet.tmax[k]), recs[k])) {
+                            packet.shrink(k, recs[k].t);
+                            hits |= 1u << k;
+                        }
+                    }
+                    return hits;
+            }
+
+            hits &= mask;
+            for (int k = 0; k < N; ++k) {
+                if (!(hits >> k & 1u))
+                    continue;
+                packet.shrink(k, t[k]);
+                recs[k].t = t[k];
+                recs[k].object = this;
+                recs[k].primitive = refIdx;
+                if (ref.type == PrimType::Quad) {
+                    recs[k].u = u[k];
+                    recs[k].v = v[k];
+                }
+            }
+            return hits;
+        }
+
+        // Lane parallel Sphere::intersect, a static sphere passes a zero centerVec
+        template<int N>
+        static uint32_t intersectSpherePacket(const RayPacket<N>& p, const point3& center0, const vec3& centerVec,
+                                              double radius, double tmin, double* tOut) {
+            uint32_t mask = 0;
+            for (int k = 0; k < N; ++k) {
+                double ocx = center0[0] + centerVec[0] * p.time[k] - p.orig[0][k];
+                double ocy = center0[1] + centerVec[1] * p.time[k] - p.orig[1][k];
+                double ocz = center0[2] + centerVec[2] * p.time[k] - p.orig[2][k];
+                double a = p.dir[0][k]*p.dir[0][k] + p.dir[1][k]*p.dir[1][k] + p.dir[2][k]*p.dir[2][k];
+                double h = p.dir[0][k]*ocx + p.dir[1][k]*ocy + p.dir[2][k]*ocz;
+                double c = ocx*ocx + ocy*ocy + ocz*ocz - radius*radius;
+
+                double det = h*h - a*c;
+                double sq = std::sqrt(det < 0.0 ? 0.0 : det);
+                double t1 = (h - sq) / a;
+                double t2 = (h + sq) / a;
+                bool near = tmin < t1 && t1 < p.tmax[k];
+                bool far  = tmin < t2 && t2 < p.tmax[k];
+                tOut[k] = near ? t1 : t2;
+                mask |= uint32_t(det >= 0.0 && (near || far)) << k;
+            }
+            return mask;
+        }
+
+        // Lane parallel Quad::intersect
+        template<int N>
+        uint32_t intersectQuadPacket(const RayPacket<N>& p, uint32_t i, double tmin, double* tOut, double* uOut,
+                                     double* vOut) const {
+            const vec3 n = m_quadNormal[i], w = m_quadW[i], qu = m_quadU[i], qv = m_quadV[i];
+            const point3 q = m_quadOrigin[i];
+            const double D = m_quadD[i];
+
+            uint32_t mask = 0;
+            for (int k = 0; k < N; ++k) {
+                double nDotDir = n[0]*p.dir[0][k] + n[1]*p.dir[1][k] + n[2]*p.dir[2][k];
+                double t = (D - (n[0]*p.orig[0][k] + n[1]*p.orig[1][k] + n[2]*p.orig[2][k])) / nDotDir;
+
+                double px = p.orig[0][k] + t*p.dir[0][k] - q[0];
+                double py = p.orig[1][k] + t*p.dir[1][k] - q[1];
+                double pz = p.orig[2][k] + t*p.dir[2][k] - q[2];
+                // alpha = dot(w, cross(p, v)), beta = dot(w, cross(u, p))
+                double alpha = w[0]*(py*qv[2] - pz*qv[1]) + w[1]*(pz*qv[0] - px*qv[2]) + w[2]*(px*qv[1] - py*qv[0]);
+                double beta  = w[0]*(qu[1]*pz - qu[2]*py) + w[1]*(qu[2]*px - qu[0]*pz) + w[2]*(qu[0]*py - qu[1]*px);
+
+                tOut[k] = t;
+                uOut[k] = alpha;
+                vOut[k] = beta;
+                bool ok = std::fabs(nDotDir) >= 1e-8 && tmin <= t && t <= p.tmax[k] &&
+                          alpha >= 0 && beta >= 0 && alpha <= 1 && beta <= 1;
+                mask |= uint32_t(ok) << k;
+            }
+            return mask;
+        }
+
+        std::vector<LinearBVHNode> m_nodes;
+        BVHLayout m_layout;
+        WideBVHTree<4> m_wide4;  // Built for BVHLayout::Wide4 only
+        WideBVHTree<8> m_wide8;  // Built for BVHLayout::Wide8 only
+        std::vector<PrimRef> m_refs;  // BVH leaf order
+        AABB m_aabb;
+
+        Vec3Array m_sphereCenter;
+        std::vector<double> m_sphereRadius;
+        std::vector<uint32_t> m_sphereMat;
+
+        Vec3Array m_movingCenter0;
+        Vec3Array m_movingCenterVec;
+        std::vector<double> m_movingRadius;
+        std::vector<uint32_t> m_movingMat;
+
+        Vec3Array m_quadOrigin;
+        Vec3Array m_quadU, m_quadV;
+        Vec3Array m_quadNormal;
+        Vec3Array m_quadW;
+        std::vector<double> m_quadD;
+        std::vector<uint32_t> m_quadMat;
+
+        Vec3Array m_boxMin, m_boxMax;
+        std::vector<uint32_t> m_boxMat;
+
+        std::vector<shared_ptr<Hittable>> m_mediumBoundary;
+        std::vector<double> m_mediumNegInvDensity;
+        std::vector<uint32_t> m_mediumMat;
+
+        std::vector<shared_ptr<Hittable>> m_generic;
+
+        std::vector<shared_ptr<Material>> m_materials;
+        std::unordered_map<const Material*, uint32_t> m_materialIds;
+
+        std::vector<const Hittable*> m_lights;
+        std::vector<shared_ptr<Hittable>> m_lightSources;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "utilities.h"
 #include "material.h"
 #include "texture.h"
+#include "volume.h"
 
 class Constant_Medium : public Hittable {
     
@@ -15,50 +16,66 @@ class Constant_Medium : public Hittable {
             m_boundary(boundary), m_negInvDensity(-1/density), m_phaseFunction(make_shared<Isotropic>(albedo)) {}
 
         bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
-            Hit_Record rec1, rec2;
-
-            //Does the ray hit the boundary
-            if(!m_boundary->hit(r, Interval::universe, rec1))
+            if (!intersect(*m_boundary, m_negInvDensity, r, ray_t, rec.t))
                 return false;
 
-            //Is ray in the boundary? (???)
-            //To confirm ray isnt on the border and exiting
-            if(!m_boundary->hit(r, Interval(rec1.t+0.0001, infinity), rec2))
-                return false;
+            rec.object = this;
+            return true;
+        }
 
-            //Clamp bounds
-            if(rec1.t < ray_t.min) rec1.t = ray_t.min;
-            if(rec2.t > ray_t.max) rec2.t = ray_t.max;
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            double t;
+            return intersect(*m_boundary, m_negInvDensity, r, ray_t, t);
+        }
 
-            if (rec1.t >= rec2.t)
-                return false;
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            return transmittance(*m_boundary, m_negInvDensity, r, ray_t);
+        }
+
+        void evaluate(const Ray& r, Hit_Record& rec) const override {
+            evaluateSurface(r, rec);
+            rec.mat = m_phaseFunction.get();
+        }
 
-            if(rec1.t < 0)
-                rec1.t = 0;
-            
-            auto ray_length = r.direction().length();
-            auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-            auto hit_distance = m_negInvDensity * std::log(random_double());
-            
-            if(hit_distance > distance_inside_boundary)
+        AABB getBoundingBox() const override {
+            return m_boundary->getBoundingBox();
+        }
+
+        // Kernels shared with CompiledScene, which keeps media in flat arrays. Each stretch inside the boundary
+        // draws its own free flight distance, which is the same thing since the exponential is memoryless.
+        static bool intersect(const Hittable& boundary, double negInvDensity, const Ray& r, const Interval& ray_t, double& t) {
+            double ray_length = r.direction().length();
+            return forEachInside(boundary, r, ray_t, [&](double t0, double t1) {
+                double hit_distance = negInvDensity * std::log(mediumRng(r, t0).uniform());
+                if (hit_distance > (t1 - t0) * ray_length)
+                    return false;
+                t = t0 + hit_distance / ray_length;
+                return true;
+            });
+        }
+
+        // Beer-Lambert over the length of r inside the boundary, exact, so shadow rays carry no noise from it
+        static double transmittance(const Hittable& boundary, double negInvDensity, const Ray& r, const Interval& ray_t) {
+            double inside = 0;
+            forEachInside(boundary, r, ray_t, [&](double t0, double t1) {
+                inside += t1 - t0;
                 return false;
+            });
+            return std::exp(inside * r.direction().length() / negInvDensity);
+        }
 
-            rec.t = rec1.t + hit_distance/ray_length;
+        static void evaluateSurface(const Ray& r, Hit_Record& rec) {
             rec.p = r.at(rec.t);
 
             //Arbitrary
             rec.normal = vec3(1, 0, 0);
             rec.front_face = true;
-            rec.mat = m_phaseFunction;
-
-            return true;
-        }
-
-        AABB getBoundingBox() const override {
-            return m_boundary->getBoundingBox();
+            rec.set_partials(vec3(), vec3());
         }
 
     private:
+        friend class CompiledScene;
+
         shared_ptr<Hittable> m_boundary;
         double m_negInvDensity;
         shared_ptr<Material> m_phaseFunction;
@@ -0,0 +1,124 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+
+#include "utilities.h"
+#include "material.h"
+#include "texture.h"
+#include "volume.h"
+
+#include <atomic>
+
+/*
+    Medium whose extinction varies through space: sigma_t times a Density_Grid, inside a closed boundary.
+
+    Free flights are sampled by delta tracking. Tentative collisions are drawn against the majorant of the
+    current Majorant_Grid cell and kept as real ones with probability sigma_t(p) / majorant, the rest are null
+    collisions the ray passes straight through. Shadow rays use ratio tracking instead, which multiplies up the
+    null collision probabilities into a transmittance, so light sampled from inside or through the medium comes
+    back as a fraction rather than all or nothing.
+*/
+class Heterogeneous_Medium : public Hittable {
+    public:
+        Heterogeneous_Medium(shared_ptr<Hittable> boundary, shared_ptr<Density_Grid> density, double sigma_t,
+                             shared_ptr<Texture> albedo)
+            : m_boundary(boundary), m_density(density), m_majorants(*density), m_sigma_t(sigma_t),
+              m_phaseFunction(make_shared<Isotropic>(albedo)), m_id(m_nextId++) {}
+
+        Heterogeneous_Medium(shared_ptr<Hittable> boundary, shared_ptr<Density_Grid> density, double sigma_t,
+                             const color& albedo)
+            : Heterogeneous_Medium(boundary, density, sigma_t, make_shared<BasicTexture>(albedo)) {}
+
+        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            if (!sampleCollision(r, ray_t, rec.t))
+                return false;
+
+            rec.object = this;
+            return true;
+        }
+
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            double t;
+            return sampleCollision(r, ray_t, t);
+        }
+
+        // Ratio tracking, with Russian roulette once little is left to carry on with
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            double ray_length = r.direction().length();
+            PCG32 rng = mediumRng(r, ray_t.min, m_id);
+            double T = 1;
+            forEachInside(*m_boundary, r, ray_t, [&](double t0, double t1) {
+                return m_majorants.traverse(r, t0, t1, [&](double c0, double c1, double majorant) {
+                    double sigma_maj = m_sigma_t * majorant;
+                    if (sigma_maj <= 0)
+                        return false;
+
+                    for (double t = c0; ; ) {
+                        t -= std::log(1 - rng.uniform()) / (sigma_maj * ray_length);
+                        if (t >= c1)
+                            return false;
+                        T *= 1 - m_sigma_t * m_density->density(r.at(t)) / sigma_maj;
+                        if (T < ROULETTE_THRESHOLD) {
+                            if (rng.uniform() >= ROULETTE_SURVIVAL) {
+                                T = 0;
+                                return true;
+                            }
+                            T /= ROULETTE_SURVIVAL;
+                        }
+                    }
+                });
+            });
+            return T;
+        }
+
+        void evaluate(const Ray& r, Hit_Record& rec) const override {
+            rec.p = r.at(rec.t);
+
+            // Arbitrary, the phase function has no use for it
+            rec.normal = vec3(1, 0, 0);
+            rec.front_face = true;
+            rec.set_partials(vec3(), vec3());
+            rec.mat = m_phaseFunction.get();
+        }
+
+        AABB getBoundingBox() const override {
+            return m_boundary->getBoundingBox();
+        }
+
+    private:
+        static constexpr double ROULETTE_THRESHOLD = 0.1;
+        static constexpr double ROULETTE_SURVIVAL = 0.5;
+
+        // Delta tracking: the first real collision inside ray_t, cells with a zero majorant cost nothing
+        bool sampleCollision(const Ray& r, const Interval& ray_t, double& t_hit) const {
+            double ray_length = r.direction().length();
+            PCG32 rng = mediumRng(r, ray_t.min, m_id);
+            return forEachInside(*m_boundary, r, ray_t, [&](double t0, double t1) {
+                return m_majorants.traverse(r, t0, t1, [&](double c0, double c1, double majorant) {
+                    double sigma_maj = m_sigma_t * majorant;
+                    if (sigma_maj <= 0)
+                        return false;
+
+                    for (double t = c0; ; ) {
+                        t -= std::log(1 - rng.uniform()) / (sigma_maj * ray_length);
+                        if (t >= c1)
+                            return false;
+                        if (rng.uniform() * sigma_maj < m_sigma_t * m_density->density(r.at(t))) {
+                            t_hit = t;
+                            return true;
+                        }
+                    }
+                });
+            });
+        }
+
+        shared_ptr<Hittable> m_boundary;
+        shared_ptr<Density_Grid> m_density;
+        Majorant_Grid m_majorants;
+        double m_sigma_t;  // Extinction per unit of density
+        shared_ptr<Material> m_phaseFunction;
+        uint64_t m_id;  // Keys the random streams apart from other media a ray crosses, see mediumRng()
+
+        static inline std::atomic<uint64_t> m_nextId{ 1 };
+};
+
+#endif
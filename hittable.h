@@ -3,137 +3,270 @@
 
 #include "utilities.h"
 #include "aabb.h"
+#include "affine.h"
+#include "light_bounds.h"
+
+#include <cstdint>
+#include <vector>
 
 class Material;
+class Hittable;
 
+/*
+    Intersection only fills t, u, v and object. The rest is filled by object->evaluate() once the closest hit
+    is known, so the per candidate cost stays at a couple of stores.
+*/
 class Hit_Record {
     public:
-        point3 p;
-        vec3 normal;
-        shared_ptr<Material> mat;
         double t;
         double u;
         double v;
+        const Hittable* object = nullptr;
+        uint32_t primitive = 0;  // For objects that keep their own primitive arrays (CompiledScene)
+
+        point3 p;
+        vec3 normal;
+        const Material* mat = nullptr;
         bool front_face = false;
     
+        // Partial derivatives of p and normal along u and v, zero for surfaces without a parameterisation
+        vec3 dpdu, dpdv;
+        vec3 dndu, dndv;
+
+        // Change of p, u and v from one pixel sample to the next, from compute_differentials()
+        vec3 dpdx, dpdy;
+        double dudx = 0, dvdx = 0, dudy = 0, dvdy = 0;
+    
         void set_face_normal(const Ray& r, const vec3& outward_normal) {
             front_face = dot(r.direction(), outward_normal) < 0;
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        // dndu and dndv belong to normal as set_face_normal() left it, facing the ray
+        void set_partials(const vec3& dpdu_, const vec3& dpdv_, const vec3& dndu_ = vec3(), const vec3& dndv_ = vec3()) {
+            dpdu = dpdu_;
+            dpdv = dpdv_;
+            dndu = dndu_;
+            dndv = dndv_;
+        }
+
+        /*
+            Screen space derivatives at an evaluated hit (pbrt's ComputeDifferentials). The offset rays are
+            intersected with the tangent plane at p, and the (u, v) steps that reach those points are the least
+            squares solution of dpdu * du + dpdv * dv = dpdx. Without a differential, or on surfaces with no
+            (u, v) partials, everything is zero and textures are looked up unfiltered.
+        */
+        void compute_differentials(const Ray_Differential& rd) {
+            dpdx = dpdy = vec3(0, 0, 0);
+            dudx = dvdx = dudy = dvdy = 0;
+            if (!rd.valid)
+                return;
+
+            double d = dot(normal, p);
+            double tx = (d - dot(normal, rd.rxOrigin)) / dot(normal, rd.rxDirection);
+            double ty = (d - dot(normal, rd.ryOrigin)) / dot(normal, rd.ryDirection);
+            if (!std::isfinite(tx) || !std::isfinite(ty))
+                return;
+            dpdx = rd.rxOrigin + tx * rd.rxDirection - p;
+            dpdy = rd.ryOrigin + ty * rd.ryDirection - p;
+
+            double ata00 = dot(dpdu, dpdu), ata01 = dot(dpdu, dpdv), ata11 = dot(dpdv, dpdv);
+            double invDet = 1 / (ata00 * ata11 - ata01 * ata01);
+            if (!std::isfinite(invDet))
+                return;
+
+            auto solve = [&](const vec3& dp, double& du, double& dv) {
+                double atb0 = dot(dpdu, dp), atb1 = dot(dpdv, dp);
+                du = (ata11 * atb0 - ata01 * atb1) * invDet;
+                dv = (ata00 * atb1 - ata01 * atb0) * invDet;
+                du = std::isfinite(du) ? std::clamp(du, -1e8, 1e8) : 0;
+                dv = std::isfinite(dv) ? std::clamp(dv, -1e8, 1e8) : 0;
+            };
+            solve(dpdx, dudx, dvdx);
+            solve(dpdy, dudy, dvdy);
+        }
 };
 
 class Hittable {
   public:
     virtual ~Hittable() = default;
 
+    // Only writes t, u, v and object, and only when it found a hit closer than ray_t.max
     virtual bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const = 0;
 
-    virtual AABB getBoundingBox() const = 0;
-};
+    // Any hit inside ray_t at all, for shadow rays. Overrides stop at the first hit they find and visit
+    // children in whatever order is cheapest.
+    virtual bool occluded(const Ray& r, const Interval& ray_t) const {
+        Hit_Record rec;
+        return hit(r, ray_t, rec);
+    }
 
-class Translate : public Hittable {
-    public:
-        Translate(shared_ptr<Hittable> object, const vec3& offset) : m_object(object), m_offset(offset) {
-            m_bbox = m_object->getBoundingBox() + offset;
-        }
-
-        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const {
-            Ray offset_ray(r.origin() - m_offset, r.direction(), r.time());
+    // Fraction of light that gets through along r inside ray_t: 0 past anything opaque, in between through
+    // media, which override this with an estimate that has no need to stop at a sampled collision
+    virtual double transmittance(const Ray& r, const Interval& ray_t) const {
+        return occluded(r, ray_t) ? 0 : 1;
+    }
 
-            if(!m_object->hit(offset_ray, ray_t, rec))
-                return false;
+    // Fills p, normal, front_face and mat for a hit this object reported. Aggregates never end up in
+    // rec.object, so they keep the empty default.
+    virtual void evaluate(const Ray& r, Hit_Record& rec) const {}
 
-            rec.p += m_offset;
+    virtual AABB getBoundingBox() const = 0;
 
-            return true;
-        }
+    // Light sampling. Emissive shapes that know how to sample themselves add themselves, aggregates and
+    // transforms pass the call on to what they hold.
+    virtual void gatherLights(std::vector<const Hittable*>& lights) const {}
 
-        AABB getBoundingBox() const {
-            return m_bbox;
-        }
+    // Solid angle density with which sampleDirection() returns the direction of r, 0 when r does not hit
+    // this object inside ray_t
+    virtual double pdfValue(const Ray& r, const Interval& ray_t) const {
+        return 0;
+    }
 
-    private:
-        shared_ptr<Hittable> m_object;
-        vec3 m_offset;    
-        AABB m_bbox;    
+    // Vector from origin to a point on this object, made from two uniform numbers. The point sits at t = 1
+    // along the returned vector.
+    virtual vec3 sampleDirection(const point3& origin, double time, const Sample2D& u) const {
+        return vec3(1, 0, 0);
+    }
 
+    // Where and how strongly a light from gatherLights() emits, for the light BVH. The default only knows
+    // the box, so it claims unit power in every direction.
+    virtual Light_Bounds lightBounds() const {
+        Light_Bounds lb;
+        lb.bounds = getBoundingBox();
+        lb.phi = 1;
+        return lb;
+    }
 };
 
-class Rotate_Y : public Hittable {
+/*
+    Places an object with an affine matrix. The constructor folds nested Transforms into one matrix, so a
+    chain like Box -> Rotate_Y -> Translate costs one ray transform and one virtual hop per hit.
+*/
+class Transform : public Hittable {
     public:
-        Rotate_Y(shared_ptr<Hittable> object, double angle) : m_object(object) {
-            auto rad = degrees_to_radians(angle);
-            m_sinTheta = std::sin(rad);
-            m_cosTheta = std::cos(rad);
-            m_bbox = m_object->getBoundingBox();
-
-            point3 min = point3(infinity, infinity, infinity);
-            point3 max = point3(-infinity, -infinity, -infinity);
-            
-            for(int i = 0; i < 2; ++i) {
-                for(int j = 0; j < 2; ++j) {
-                    for(int k = 0; k < 2; ++k) {
-                        auto x = i * m_bbox.m_boxMax.x() + (i-1)*m_bbox.m_boxMin.x();
-                        auto y = j * m_bbox.m_boxMax.y() + (j-1)*m_bbox.m_boxMin.y();
-                        auto z = k * m_bbox.m_boxMax.z() + (k-1)*m_bbox.m_boxMin.z();
-                        
-                        auto newX = m_cosTheta*x + m_sinTheta*z;
-                        auto newZ = -m_sinTheta*x + m_cosTheta*z;
-                        
-                        vec3 tester(newX, y, newZ);
-                        for(int c = 0; c < 3; ++c) {
-                            min[c] = std::fmin(min[c], tester[c]);
-                            max[c] = std::fmax(max[c], tester[c]);
-                        }
-                    }
-                }
+        Transform(shared_ptr<Hittable> object, const Affine& objectToWorld) : m_object(object) {
+            if (auto inner = std::dynamic_pointer_cast<Transform>(object)) {
+                m_object = inner->m_object;
+                m_inner = inner->m_objectToWorld;
             }
-
-            m_bbox = AABB(min, max);
+            setTransform(objectToWorld);
         }
 
-        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const {
-             // Change the ray from world space to object space
-            auto origin = r.origin();
-            auto direction = r.direction();
-
-            origin[0] = m_cosTheta*r.origin()[0] - m_sinTheta*r.origin()[2];
-            origin[2] = m_sinTheta*r.origin()[0] + m_cosTheta*r.origin()[2];
-
-            direction[0] = m_cosTheta*r.direction()[0] - m_sinTheta*r.direction()[2];
-            direction[2] = m_sinTheta*r.direction()[0] + m_cosTheta*r.direction()[2];
+        // Replaces the matrix given at construction, any folded inner transforms still apply first
+        void setTransform(const Affine& objectToWorld) {
+            m_outer = objectToWorld;
+            m_objectToWorld = m_outer * m_inner;
+            m_worldToObject = m_objectToWorld.inverse();
+            m_determinant = m_objectToWorld.determinant();
+            m_bbox = m_objectToWorld.applyBox(m_object->getBoundingBox());
+        }
 
-            Ray rotated_r(origin, direction, r.time());
+        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            // The direction is not renormalized, so t means the same thing in both spaces
+            Ray local_r(m_worldToObject.applyPoint(r.origin()), m_worldToObject.applyVector(r.direction()), r.time());
 
-            // Determine whether an intersection exists in object space (and if so, where)
-            if (!m_object->hit(rotated_r, ray_t, rec))
+            if (!m_object->hit(local_r, ray_t, rec))
                 return false;
 
-            // Change the intersection point from object space to world space
-            auto p = rec.p;
-            p[0] =  m_cosTheta*rec.p[0] + m_sinTheta*rec.p[2];
-            p[2] = -m_sinTheta*rec.p[0] + m_cosTheta*rec.p[2];
-
-            // Change the normal from object space to world space
-            auto normal = rec.normal;
-            normal[0] =  m_cosTheta*rec.normal[0] + m_sinTheta*rec.normal[2];
-            normal[2] = -m_sinTheta*rec.normal[0] + m_cosTheta*rec.normal[2];
+            // Evaluated right away since the local ray is gone afterwards. This runs once per transform entry,
+            // not once per primitive tested inside it.
+            rec.object->evaluate(local_r, rec);
+            rec.object = this;
+            rec.p = m_objectToWorld.applyPoint(rec.p);
+            // Normals go through the inverse transpose. Sidedness is unchanged since dot(M d, M^-T n) = dot(d, n).
+            vec3 normal = m_worldToObject.applyTransposed(rec.normal);
+            double normalLength = normal.length();
+            rec.normal = normal / normalLength;
 
-            rec.p = p;
-            rec.normal = normal;
+            // Partials are vectors, the normal's go through the same map as the normal, less the part along it
+            // that the normalisation takes out
+            rec.dpdu = m_objectToWorld.applyVector(rec.dpdu);
+            rec.dpdv = m_objectToWorld.applyVector(rec.dpdv);
+            vec3 dndu = m_worldToObject.applyTransposed(rec.dndu);
+            vec3 dndv = m_worldToObject.applyTransposed(rec.dndv);
+            rec.dndu = (dndu - dot(dndu, rec.normal) * rec.normal) / normalLength;
+            rec.dndv = (dndv - dot(dndv, rec.normal) * rec.normal) / normalLength;
 
             return true;
         }
 
+        // Already evaluated in hit()
+        void evaluate(const Ray& r, Hit_Record& rec) const override {}
+
         AABB getBoundingBox() const override {
             return m_bbox;
-        } 
+        }
+
+        // A transformed light is sampled through its object, so only objects that are lights themselves
+        // count. Lights inside a transformed aggregate are still found by scattered rays.
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            std::vector<const Hittable*> inner;
+            m_object->gatherLights(inner);
+            if (inner.size() == 1 && inner[0] == m_object.get())
+                lights.push_back(this);
+        }
+
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            Ray local_r(m_worldToObject.applyPoint(r.origin()), m_worldToObject.applyVector(r.direction()), r.time());
+            return m_object->occluded(local_r, ray_t);
+        }
+
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            Ray local_r(m_worldToObject.applyPoint(r.origin()), m_worldToObject.applyVector(r.direction()), r.time());
+            return m_object->transmittance(local_r, ray_t);
+        }
+
+        double pdfValue(const Ray& r, const Interval& ray_t) const override {
+            vec3 local_dir = m_worldToObject.applyVector(r.direction());
+            Ray local_r(m_worldToObject.applyPoint(r.origin()), local_dir, r.time());
+            // The linear part maps unit direction d to M d / |M d|, which scales solid angle by |det M| / |M d|^3
+            double stretch = r.direction().length() / local_dir.length();
+            return m_object->pdfValue(local_r, ray_t) * stretch * stretch * stretch / std::fabs(m_determinant);
+        }
+
+        vec3 sampleDirection(const point3& origin, double time, const Sample2D& u) const override {
+            vec3 local = m_object->sampleDirection(m_worldToObject.applyPoint(origin), time, u);
+            return m_objectToWorld.applyVector(local);
+        }
+
+        // A plane stays a plane, so a flat emitter keeps its single normal (through the inverse transpose) and
+        // its power scales with its area. Any other normal cone may be skewed arbitrarily and becomes the whole
+        // sphere, with power scaled by the average stretch.
+        Light_Bounds lightBounds() const override {
+            Light_Bounds lb = m_object->lightBounds();
+            lb.bounds = m_objectToWorld.applyBox(lb.bounds);
+            if (lb.cosTheta_o == 1) {
+                vec3 n = m_worldToObject.applyTransposed(lb.w);
+                lb.phi *= std::fabs(m_determinant) * n.length() / lb.w.length();
+                lb.w = unit_vector(n);
+            } else {
+                lb.cosTheta_o = -1;
+                lb.phi *= std::pow(std::fabs(m_determinant), 2.0 / 3.0);
+            }
+            return lb;
+        }
 
     private:
         shared_ptr<Hittable> m_object;
-        double m_sinTheta;
-        double m_cosTheta;
+        Affine m_inner;          // Folded in from nested Transforms
+        Affine m_outer;
+        Affine m_objectToWorld;  // m_outer * m_inner
+        Affine m_worldToObject;
+        double m_determinant;
         AABB m_bbox;
 };
 
+class Translate : public Transform {
+    public:
+        Translate(shared_ptr<Hittable> object, const vec3& offset)
+            : Transform(object, Affine::translation(offset)) {}
+};
+
+class Rotate_Y : public Transform {
+    public:
+        Rotate_Y(shared_ptr<Hittable> object, double angle)
+            : Transform(object, Affine::rotation(vec3(0, 1, 0), angle)) {}
+};
+
 #endif
\ No newline at end of file
@@ -24,14 +24,13 @@ class Hittable_List : public Hittable {
         }
 
         bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
-            Hit_Record record;
             bool hit_anything = false;
             double closest_so_far = ray_t.max;
 
+            // Objects only write to rec when they beat closest_so_far, so no scratch record is needed
             for(const shared_ptr<Hittable>& obj : objects) {
-                if(obj->hit(r, Interval(ray_t.min, closest_so_far), record)) {
+                if(obj->hit(r, Interval(ray_t.min, closest_so_far), rec)) {
                     hit_anything = true;
-                    rec = record;
                     closest_so_far = rec.t;
                 }   
             }
@@ -39,12 +38,34 @@ class Hittable_List : public Hittable {
             return hit_anything;
         }
 
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            for (const shared_ptr<Hittable>& obj : objects)
+                if (obj->occluded(r, ray_t))
+                    return true;
+            return false;
+        }
+
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            double T = 1;
+            for (const shared_ptr<Hittable>& obj : objects) {
+                T *= obj->transmittance(r, ray_t);
+                if (T <= 0)
+                    return 0;
+            }
+            return T;
+        }
+
         AABB getBoundingBox() const override {
             return m_aabb;
         }
 
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            for (const shared_ptr<Hittable>& obj : objects)
+                obj->gatherLights(lights);
+        }
+
     private:
-        AABB m_aabb;
+        AABB m_aabb = AABB::empty;
 };
 
 #endif
\ No newline at end of file
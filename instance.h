@@ -0,0 +1,75 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "utilities.h"
+#include "hittable.h"
+#include "bvh_node.h"
+
+#include <vector>
+
+// One placement of a shared bottom level structure (usually a BVH_Node). Only the matrices are stored per
+// instance, so 10,000 copies of a mesh cost 10,000 transforms and one mesh.
+using Instance = Transform;
+
+/*
+    Top level BVH over instances. Moving instances around only needs setTransform() followed by refit(), which
+    keeps the tree topology and just recomputes bounds. Call build() again once the instances have moved far
+    enough that the old topology gets slow.
+*/
+class Instance_BVH : public Hittable {
+    public:
+        Instance_BVH(BVHBuildMethod method = BVHBuildMethod::SAH) : m_method(method) {}
+
+        size_t add(shared_ptr<Hittable> blas, const Affine& objectToWorld) {
+            m_instances.push_back(make_shared<Instance>(blas, objectToWorld));
+            return m_instances.size() - 1;
+        }
+
+        void setTransform(size_t index, const Affine& objectToWorld) {
+            m_instances[index]->setTransform(objectToWorld);
+        }
+
+        void build() {
+            std::vector<shared_ptr<Hittable>> objects(m_instances.begin(), m_instances.end());
+            m_tlas = make_shared<BVH_Node>(objects, 0, objects.size(), 1, m_method);
+        }
+
+        void refit() {
+            if (m_tlas)
+                m_tlas->refit();
+            else
+                build();
+        }
+
+        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            return m_tlas && m_tlas->hit(r, ray_t, rec);
+        }
+
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            return m_tlas && m_tlas->occluded(r, ray_t);
+        }
+
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            return m_tlas ? m_tlas->transmittance(r, ray_t) : 1;
+        }
+
+        AABB getBoundingBox() const override {
+            return m_tlas ? m_tlas->getBoundingBox() : AABB::empty;
+        }
+
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            for (const auto& instance : m_instances)
+                instance->gatherLights(lights);
+        }
+
+        size_t size() const {
+            return m_instances.size();
+        }
+
+    private:
+        BVHBuildMethod m_method;
+        std::vector<shared_ptr<Instance>> m_instances;  // In insertion order, the TLAS holds the same objects
+        shared_ptr<BVH_Node> m_tlas;
+};
+
+#endif
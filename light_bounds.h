@@ -0,0 +1,155 @@
+#ifndef LIGHT_BOUNDS_H
+#define LIGHT_BOUNDS_H
+
+#include "aabb.h"
+
+#include <algorithm>
+
+/*
+    What the light BVH knows about an emitter, or a group of them, without looking at its surface (pbrt's
+    LightBounds): where it is, how much power it puts out (phi) and in which directions. Surface normals lie
+    in the cone of half angle theta_o around w, and light leaves each of them at up to theta_e from it (pi/2 for
+    diffuse emitters). cosTheta_o = -1 is the whole sphere of normals, as on a sphere light.
+*/
+struct Light_Bounds {
+    AABB bounds = AABB::empty;
+    vec3 w = vec3(0, 0, 1);
+    double phi = 0;
+    double cosTheta_o = -1;
+    double cosTheta_e = 0;
+    bool twoSided = false;
+
+    /*
+        Conservative estimate of what the emitters could contribute at p: power over squared distance, times
+        the largest emission cosine towards p that the cone allows, times the largest cosine at the receiver
+        for any point in the box. n is zero for points in media, which have no receiving cosine.
+    */
+    double importance(const point3& p, const vec3& n) const {
+        point3 pc = bounds.centroid();
+        vec3 diagonal = bounds.m_boxMax - bounds.m_boxMin;
+        double d2 = std::max((p - pc).length_squared(), diagonal.length() / 2);
+
+        // Angle from the cone axis to p, less the cone's spread and the angle the box covers as seen from p
+        vec3 wi = unit_vector(p - pc);
+        double cosTheta_w = dot(w, wi);
+        if (twoSided)
+            cosTheta_w = std::fabs(cosTheta_w);
+        double sinTheta_w = safeSqrt(1 - cosTheta_w * cosTheta_w);
+
+        double cosTheta_b = cosSubtended(p);
+        double sinTheta_b = safeSqrt(1 - cosTheta_b * cosTheta_b);
+        double sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+
+        double cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+        double sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+        double cosThetap = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+        if (cosThetap <= cosTheta_e)
+            return 0;
+
+        double result = phi * cosThetap / d2;
+        if (n.x() != 0 || n.y() != 0 || n.z() != 0) {
+            double cosTheta_i = std::fabs(dot(wi, n));
+            double sinTheta_i = safeSqrt(1 - cosTheta_i * cosTheta_i);
+            result *= cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+        }
+        return std::max(result, 0.0);
+    }
+
+    // Surface area orientation heuristic cost (pbrt's EvaluateCost) of these bounds as one child of a split
+    // along axis inside parent
+    double splitCost(const AABB& parent, int axis) const {
+        double theta_o = std::acos(std::clamp(cosTheta_o, -1.0, 1.0));
+        double theta_e = std::acos(std::clamp(cosTheta_e, -1.0, 1.0));
+        double theta_w = std::min(theta_o + theta_e, pi);
+        double sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+        double M_omega = 2 * pi * (1 - cosTheta_o) +
+                         pi / 2 * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+                                   2 * theta_o * sinTheta_o + cosTheta_o);
+
+        // Long thin parents should be split across their long side
+        vec3 d = parent.m_boxMax - parent.m_boxMin;
+        double Kr = std::max(d[0], std::max(d[1], d[2])) / d[axis];
+        return phi * M_omega * Kr * bounds.surfaceArea();
+    }
+
+    static double safeSqrt(double x) {
+        return std::sqrt(std::max(0.0, x));
+    }
+
+  private:
+    // Cosine of the half angle of the cone from p around the box centre that holds the box, -1 from inside
+    double cosSubtended(const point3& p) const {
+        point3 center = bounds.centroid();
+        double radius2 = (bounds.m_boxMax - center).length_squared();
+        double dist2 = (p - center).length_squared();
+        if (dist2 < radius2)
+            return -1;
+        return safeSqrt(1 - radius2 / dist2);
+    }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    static double cosSubClamped(double sinA, double cosA, double sinB, double cosB) {
+        if (cosA > cosB)
+            return 1;
+        return cosA * cosB + sinA * sinB;
+    }
+
+    static double sinSubClamped(double sinA, double cosA, double sinB, double cosB) {
+        if (cosA > cosB)
+            return 0;
+        return sinA * cosB - cosA * sinB;
+    }
+};
+
+// Angle between unit vectors, accurate for nearly parallel and nearly opposite ones
+inline double angleBetween(const vec3& a, const vec3& b) {
+    if (dot(a, b) < 0)
+        return pi - 2 * std::asin(std::min(1.0, (a + b).length() / 2));
+    return 2 * std::asin(std::min(1.0, (b - a).length() / 2));
+}
+
+// Rotates v by angle radians around the unit axis k (Rodrigues' formula)
+inline vec3 rotateAround(const vec3& v, const vec3& k, double angle) {
+    double c = std::cos(angle), s = std::sin(angle);
+    return v * c + cross(k, v) * s + k * (dot(k, v) * (1 - c));
+}
+
+// Bounds of both groups: the box and power add up, the normal cones merge into the smallest cone holding both
+inline Light_Bounds unionBounds(const Light_Bounds& a, const Light_Bounds& b) {
+    if (a.phi == 0)
+        return b;
+    if (b.phi == 0)
+        return a;
+
+    Light_Bounds u;
+    u.bounds = AABB(a.bounds, b.bounds);
+    u.phi = a.phi + b.phi;
+    u.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+    u.twoSided = a.twoSided || b.twoSided;
+
+    double theta_a = std::acos(std::clamp(a.cosTheta_o, -1.0, 1.0));
+    double theta_b = std::acos(std::clamp(b.cosTheta_o, -1.0, 1.0));
+    double theta_d = angleBetween(a.w, b.w);
+    if (std::min(theta_d + theta_b, pi) <= theta_a) {
+        u.w = a.w;
+        u.cosTheta_o = a.cosTheta_o;
+        return u;
+    }
+    if (std::min(theta_d + theta_a, pi) <= theta_b) {
+        u.w = b.w;
+        u.cosTheta_o = b.cosTheta_o;
+        return u;
+    }
+
+    double theta_o = (theta_a + theta_d + theta_b) / 2;
+    vec3 axis = cross(a.w, b.w);
+    if (theta_o >= pi || axis.length_squared() == 0) {
+        u.cosTheta_o = -1;
+        return u;
+    }
+    u.w = unit_vector(rotateAround(a.w, unit_vector(axis), theta_o - theta_a));
+    u.cosTheta_o = std::cos(theta_o);
+    return u;
+}
+
+#endif
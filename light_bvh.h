@@ -0,0 +1,224 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "hittable.h"
+
+#include <vector>
+
+/*
+    Hierarchy over the scene's lights for next event estimation (pbrt's BVHLightSampler). Each node keeps the
+    Light_Bounds of everything below it. A light is picked by walking down from the root, at every node taking
+    a child with probability proportional to its importance at the shading point, so a sample costs one
+    root-to-leaf walk however many lights there are, and lights that are far, dim or facing away are rarely
+    picked.
+
+    Nodes are stored depth first: the first child follows its parent, the parent keeps the second's index.
+*/
+class LightBVH {
+    public:
+        LightBVH() = default;
+        LightBVH(const std::vector<const Hittable*>& lights) {
+            build(lights);
+        }
+
+        void build(const std::vector<const Hittable*>& lights) {
+            m_nodes.clear();
+            m_lights.clear();
+
+            // Lights that emit nothing can never be picked, scattered rays still find them
+            std::vector<Item> items;
+            for (const Hittable* light : lights) {
+                Light_Bounds lb = light->lightBounds();
+                if (lb.phi > 0) {
+                    items.push_back(Item{ lb, int(m_lights.size()) });
+                    m_lights.push_back(light);
+                }
+            }
+            if (!items.empty())
+                buildRecursive(items, 0, items.size());
+        }
+
+        bool empty() const {
+            return m_nodes.empty();
+        }
+
+        size_t size() const {
+            return m_lights.size();
+        }
+
+        // Picks a light for a shading point at p with normal n (zero inside media) from one uniform number.
+        // Returns null when nothing can light p.
+        const Hittable* sample(const point3& p, const vec3& n, double u, double& pmf) const {
+            if (m_nodes.empty())
+                return nullptr;
+
+            int index = 0;
+            pmf = 1;
+            while (!m_nodes[index].isLeaf) {
+                const Node& node = m_nodes[index];
+                double i0 = m_nodes[index + 1].bounds.importance(p, n);
+                double i1 = m_nodes[node.offset].bounds.importance(p, n);
+                if (i0 <= 0 && i1 <= 0)
+                    return nullptr;
+
+                // The same number picks the child and, stretched back to [0,1), goes on down
+                double p0 = i0 / (i0 + i1);
+                if (u < p0) {
+                    index = index + 1;
+                    u = std::min(u / p0, ONE_MINUS_EPSILON);
+                    pmf *= p0;
+                } else {
+                    index = node.offset;
+                    u = std::min((u - p0) / (1 - p0), ONE_MINUS_EPSILON);
+                    pmf *= 1 - p0;
+                }
+            }
+
+            // Below the root a leaf was chosen for its importance already
+            if (index == 0 && m_nodes[0].bounds.importance(p, n) <= 0)
+                return nullptr;
+            return m_lights[m_nodes[index].offset];
+        }
+
+        /*
+            Density with which sample() followed by the light's sampleDirection() produces the direction of r,
+            from r's origin with normal n, summed over the lights r reaches inside ray_t. Only nodes whose box r
+            passes through can hold such a light, and the pick probabilities are gathered on the way down.
+        */
+        double pdf(const Ray& r, const Interval& ray_t, const vec3& n) const {
+            if (m_nodes.empty())
+                return 0;
+
+            const point3& p = r.origin();
+            if (m_nodes[0].isLeaf && m_nodes[0].bounds.importance(p, n) <= 0)
+                return 0;
+
+            struct Entry {
+                int index;
+                double pmf;
+            };
+            Entry stack[MAX_DEPTH + 1];
+            int top = 0;
+            stack[top++] = Entry{ 0, 1.0 };
+
+            double sum = 0;
+            while (top > 0) {
+                Entry e = stack[--top];
+                const Node& node = m_nodes[e.index];
+                if (!node.bounds.bounds.hit(r, ray_t))
+                    continue;
+
+                if (node.isLeaf) {
+                    sum += e.pmf * m_lights[node.offset]->pdfValue(r, ray_t);
+                    continue;
+                }
+
+                double i0 = m_nodes[e.index + 1].bounds.importance(p, n);
+                double i1 = m_nodes[node.offset].bounds.importance(p, n);
+                if (i0 <= 0 && i1 <= 0)
+                    continue;
+                if (i0 > 0)
+                    stack[top++] = Entry{ e.index + 1, e.pmf * i0 / (i0 + i1) };
+                if (i1 > 0)
+                    stack[top++] = Entry{ node.offset, e.pmf * i1 / (i0 + i1) };
+            }
+            return sum;
+        }
+
+    private:
+        struct Node {
+            Light_Bounds bounds;
+            int offset;   // Second child for interior nodes, index into m_lights for leaves
+            bool isLeaf;
+        };
+
+        struct Item {
+            Light_Bounds bounds;
+            int light;
+        };
+
+        static constexpr double ONE_MINUS_EPSILON = 0x1.fffffffffffffp-1;
+        static constexpr int BUCKETS = 12;
+        static constexpr int MAX_DEPTH = 64;  // Bounds the traversal stack in pdf()
+
+        // Splits items[begin, end) where the surface area orientation heuristic says, one light per leaf.
+        // Deep down the tree splits turn into plain halving so lopsided splits cannot outgrow MAX_DEPTH.
+        int buildRecursive(std::vector<Item>& items, size_t begin, size_t end, int depth = 0) {
+            int index = int(m_nodes.size());
+            m_nodes.push_back(Node{});
+
+            if (end - begin == 1) {
+                m_nodes[index] = Node{ items[begin].bounds, items[begin].light, true };
+                return index;
+            }
+
+            Light_Bounds total;
+            AABB centroidBounds = AABB::empty;
+            for (size_t i = begin; i < end; ++i) {
+                total = unionBounds(total, items[i].bounds);
+                point3 c = items[i].bounds.bounds.centroid();
+                centroidBounds = AABB(centroidBounds, AABB(c, c));
+            }
+
+            // Cheapest bucket boundary over all three axes
+            double bestCost = infinity;
+            int bestAxis = -1, bestBucket = -1;
+            for (int axis = 0; axis < 3; ++axis) {
+                Interval span = centroidBounds.axisBounds(axis);
+                if (span.max <= span.min)
+                    continue;
+
+                Light_Bounds buckets[BUCKETS];
+                for (size_t i = begin; i < end; ++i) {
+                    Light_Bounds& bucket = buckets[bucketOf(items[i], span, axis)];
+                    bucket = unionBounds(bucket, items[i].bounds);
+                }
+
+                Light_Bounds below[BUCKETS];
+                below[0] = buckets[0];
+                for (int b = 1; b < BUCKETS; ++b)
+                    below[b] = unionBounds(below[b - 1], buckets[b]);
+
+                Light_Bounds above;
+                for (int b = BUCKETS - 1; b > 0; --b) {
+                    above = unionBounds(above, buckets[b]);
+                    if (below[b - 1].phi == 0 || above.phi == 0)
+                        continue;
+                    double cost = below[b - 1].splitCost(total.bounds, axis) + above.splitCost(total.bounds, axis);
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestBucket = b;
+                    }
+                }
+            }
+
+            size_t mid = begin + (end - begin) / 2;
+            if (bestAxis >= 0 && depth < MAX_DEPTH - 32) {
+                Interval span = centroidBounds.axisBounds(bestAxis);
+                auto split = std::partition(items.begin() + begin, items.begin() + end, [&](const Item& item) {
+                    return bucketOf(item, span, bestAxis) < bestBucket;
+                });
+                mid = size_t(split - items.begin());
+            }
+            // Every light in one spot, or every light landing on one side: halve the list
+            if (mid == begin || mid == end)
+                mid = begin + (end - begin) / 2;
+
+            buildRecursive(items, begin, mid, depth + 1);
+            int second = buildRecursive(items, mid, end, depth + 1);
+            m_nodes[index] = Node{ total, second, false };
+            return index;
+        }
+
+        static int bucketOf(const Item& item, const Interval& span, int axis) {
+            double c = item.bounds.bounds.centroid()[axis];
+            int b = int(BUCKETS * (c - span.min) / (span.max - span.min));
+            return std::min(std::max(b, 0), BUCKETS - 1);
+        }
+
+        std::vector<Node> m_nodes;
+        std::vector<const Hittable*> m_lights;
+};
+
+#endif
@@ -2,12 +2,15 @@
 
 #include "camera.h"
 #include "constant_media.h"
+#include "heterogeneous_medium.h"
 #include "hittable_list.h"
 #include "sphere.h"
 #include "box.h"
 #include "quad.h"
 #include "material.h"
 #include "bvh_node.h"
+#include "wide_bvh.h"
+#include "instance.h"
 
 void bouncingSpheres() {
     Hittable_List world;
@@ -53,7 +56,7 @@ void bouncingSpheres() {
     auto material3 = make_shared<Metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<Box>(point3(4, 1, 0), vec3(1), material3));
 
-    world = Hittable_List(make_shared<BVH_Node>(world));
+    world = Hittable_List(make_shared<BVH4>(world));
 
     Camera cam;
 
@@ -300,6 +303,141 @@ void cornell_smoke() {
     cam.render(world);
 }
 
+void cornell_cloud() {
+    Hittable_List world;
+
+    auto red   = make_shared<Lambertian>(color(.65, .05, .05));
+    auto white = make_shared<Lambertian>(color(.73, .73, .73));
+    auto green = make_shared<Lambertian>(color(.12, .45, .15));
+    auto light = make_shared<Emissive>(color(15, 15, 15));
+
+    world.add(make_shared<Quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<Quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<Quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
+    world.add(make_shared<Quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<Quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<Quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    // Turbulence thresholded into wisps, so most of the majorant grid is empty and gets skipped
+    AABB cloudBounds(point3(80, 60, 80), point3(475, 420, 475));
+    Perlin noise(7);
+    auto density = Density_Grid::fromFunction(cloudBounds, 96, 96, 96, [&](const point3& p) {
+        return 4 * (noise.turb(p / 90, 7) - 0.35);
+    });
+    auto boundary = make_shared<Sphere>(point3(277, 240, 277), 200, white);
+    world.add(make_shared<Heterogeneous_Medium>(boundary, density, 0.2, color(0.9, 0.9, 0.9)));
+
+    Camera cam;
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 200;
+    cam.max_depth         = 50;
+    cam.background_color  = color(0,0,0);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+void instancedForest() {
+    // One small cluster of spheres, placed 10,000 times through the top level BVH
+    Hittable_List cluster;
+    auto leaf = make_shared<Lambertian>(color(0.2, 0.6, 0.2));
+    for (int i = 0; i < 64; i++) {
+        point3 center = vec3::random(-0.3, 0.3) + point3(0, 0.4 + 0.6*random_double(), 0);
+        cluster.add(make_shared<Sphere>(center, 0.08, leaf));
+    }
+    cluster.add(make_shared<Box>(point3(0, 0.2, 0), vec3(0.05, 0.2, 0.05), make_shared<Lambertian>(color(0.4, 0.25, 0.1))));
+    auto blas = make_shared<BVH_Node>(cluster);
+
+    Instance_BVH forest;
+    for (int a = 0; a < 100; a++) {
+        for (int b = 0; b < 100; b++) {
+            Affine xform = Affine::translation(point3(a - 50 + 0.5*random_double(), 0, -b + 0.5*random_double()))
+                         * Affine::rotation(vec3(0, 1, 0), random_double(0, 360))
+                         * Affine::scaling(vec3(random_double(0.6, 1.2)));
+            forest.add(blas, xform);
+        }
+    }
+    forest.build();
+
+    Hittable_List world;
+    world.add(make_shared<Sphere>(point3(0,-1000,0), 1000, make_shared<Lambertian>(color(0.5, 0.45, 0.35))));
+    world.add(make_shared<Instance_BVH>(forest));
+
+    Camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+    cam.background_color  = color(0.70, 0.80, 1.00);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(0,4,6);
+    cam.lookat   = point3(0,0,-10);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+void nightCity() {
+    // A grid of dark towers with lit windows and street lamps, about a thousand lights in all
+    Hittable_List world;
+    auto asphalt = make_shared<Lambertian>(color(0.15, 0.15, 0.17));
+    auto concrete = make_shared<Lambertian>(color(0.4, 0.4, 0.42));
+    auto neon = make_shared<Emissive>(make_shared<EmissiveNoiseTexture>(2, 3));
+    auto lamp = make_shared<Emissive>(color(12, 9, 5));
+    world.add(make_shared<Quad>(point3(-60, 0, 20), vec3(120, 0, 0), vec3(0, 0, -140), asphalt));
+
+    for (int a = -6; a <= 6; a++) {
+        for (int b = 0; b < 12; b++) {
+            point3 base(a * 8.0, 0, -b * 10.0);
+            double height = random_double(4, 20);
+            vec3 half(2.5, height / 2, 2.5);
+            world.add(make_shared<Box>(base + vec3(0, height / 2, 0), half, concrete));
+
+            // Windows on the street side, each a light of its own
+            for (double y = 1; y + 1 < height; y += 1.5) {
+                for (double x = -2; x < 2; x += 1.0) {
+                    if (random_double() < 0.5)
+                        continue;
+                    auto glow = random_double() < 0.1 ? neon
+                              : make_shared<Emissive>(color(1.0, 0.8, 0.5) * random_double(1, 6));
+                    world.add(make_shared<Quad>(base + point3(x + 0.2, y, 2.51), vec3(0.6, 0, 0), vec3(0, 0.8, 0), glow));
+                }
+            }
+
+            world.add(make_shared<Sphere>(base + point3(4, 3, 4), 0.15, lamp));
+        }
+    }
+
+    Camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 20;
+    cam.background_color  = color(0.01, 0.01, 0.03);
+
+    cam.vfov     = 35;
+    cam.lookfrom = point3(10, 6, 18);
+    cam.lookat   = point3(0, 5, -30);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
 int main() {
     switch(8) {
         case 1: bouncingSpheres();  break;
@@ -310,5 +448,8 @@ int main() {
         case 6: simple_light();     break;
         case 7: cornell_box();      break;
         case 8: cornell_smoke();    break;
+        case 9: instancedForest();  break;
+        case 10: nightCity();       break;
+        case 11: cornell_cloud();   break;
     }
 }
\ No newline at end of file
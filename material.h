@@ -3,35 +3,149 @@
 
 #include "utilities.h"
 #include "texture.h"
+#include "sampler.h"
+#include "onb.h"
 
 class Hit_record;
 
+// Material classes, so the wavefront integrator can group hits that run the same sample() code
+enum class Material_Type : uint8_t {
+    Other,
+    Lambertian,
+    Metal,
+    Dielectric,
+    Emissive,
+    Isotropic,
+};
+
+/*
+    Result of Material::sample(). attenuation is the path weight of the sample, eval() / pdf() for smooth
+    lobes, so the integrator multiplies by it and never divides. pdf is the solid angle density of the chosen
+    direction, 0 when it came from a delta lobe (is_specular), which no other strategy can produce.
+*/
+struct Scatter_Record {
+    Ray scattered;
+    color attenuation;
+    double pdf = 0;
+    bool is_specular = false;
+};
+
 class Material {
   public:
     virtual ~Material() = default;
 
-    virtual bool scatter( const Ray& r_in, const Hit_Record& rec, color& attenuation, Ray& scattered) const {
+    // Picks the next direction from the material's own distribution, false when the path ends here
+    virtual bool sample(const Ray& r_in, const Hit_Record& rec, Sampler& sampler, Scatter_Record& srec) const {
         return false;
     }
 
     virtual color emitted(double u, double v, const point3& p) const {
         return color(0, 0, 0);
     }
+
+    // Shapes with an emissive material put themselves on the light list
+    virtual bool isEmissive() const {
+        return false;
+    }
+
+    // True when sample() draws from a delta distribution (mirrors, glass) or one pdf() cannot evaluate.
+    // Light sampling skips these, so everything they see comes in through scattered rays.
+    virtual bool isSpecular() const {
+        return true;
+    }
+
+    // Phase functions of media scatter the same way around any axis, rec.normal means nothing to them
+    virtual bool isVolumetric() const {
+        return false;
+    }
+
+    virtual Material_Type type() const {
+        return Material_Type::Other;
+    }
+
+    // Scattering function times the cosine at the surface, for light arriving along direction
+    virtual color eval(const Ray& r_in, const Hit_Record& rec, const vec3& direction) const {
+        return color(0, 0, 0);
+    }
+
+    // Solid angle density with which sample() picks direction
+    virtual double pdf(const Ray& r_in, const Hit_Record& rec, const vec3& direction) const {
+        return 0;
+    }
+
+    // Ray differential of srec.scattered, given the one of r_in and a hit with its differentials computed.
+    // Only mirror and glass bounces keep a footprint worth following, the default drops it.
+    virtual bool scatterDifferential(const Ray& r_in, const Ray_Differential& in, const Hit_Record& rec,
+                                     const Scatter_Record& srec, Ray_Differential& out) const {
+        return false;
+    }
 };
 
+/*
+    Differential after a specular bounce (after pbrt's SpecularReflect / SpecularTransmit, with the bend done
+    exactly instead of to first order). The offset rays leave from where they met the tangent plane, bent by
+    bend(unit direction, unit normal) around the normal moved along by its derivative. Their change of
+    direction is scaled to the length of the scattered direction, which the materials do not keep at 1.
+*/
+template<typename F>
+bool specularDifferential(const Ray& r_in, const Ray_Differential& in, const Hit_Record& rec, const Ray& scattered,
+                          F&& bend, Ray_Differential& out) {
+    if (!in.valid)
+        return false;
+
+    vec3 dndx = rec.dndu * rec.dudx + rec.dndv * rec.dvdx;
+    vec3 dndy = rec.dndu * rec.dudy + rec.dndv * rec.dvdy;
+    vec3 wi, wx, wy;
+    if (!bend(unit_vector(r_in.direction()), rec.normal, wi) ||
+        !bend(unit_vector(in.rxDirection), unit_vector(rec.normal + dndx), wx) ||
+        !bend(unit_vector(in.ryDirection), unit_vector(rec.normal + dndy), wy))
+        return false;
+
+    double length = scattered.direction().length();
+    out.rxOrigin = rec.p + rec.dpdx;
+    out.ryOrigin = rec.p + rec.dpdy;
+    out.rxDirection = scattered.direction() + length * (wx - wi);
+    out.ryDirection = scattered.direction() + length * (wy - wi);
+    out.valid = true;
+    return true;
+}
+
 class Lambertian : public Material {
     public:
         Lambertian(const color& albedo) : m_texture(make_shared<BasicTexture>(albedo)) {}
         Lambertian(shared_ptr<Texture> tex): m_texture(tex) {}
 
-        bool scatter( const Ray& r_in, const Hit_Record& rec, color& attenuation, Ray& scattered) const {
-            auto scatter_direction = rec.normal + random_unit_vector();
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
-            scattered = Ray(rec.p, scatter_direction, r_in.time());
-            attenuation = m_texture->value(rec.u, rec.v, rec.p);
+        // Cosine weighted hemisphere by Malley's method: a uniform point on the disk (concentric map, so
+        // strata stay compact) lifted onto the hemisphere. eval / pdf is then just the albedo.
+        bool sample(const Ray& r_in, const Hit_Record& rec, Sampler& sampler, Scatter_Record& srec) const override {
+            Sample2D u = sampler.get2D();
+            vec3 d = sample_unit_disk(u.x, u.y);
+            double z = std::sqrt(std::fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+            vec3 direction = ONB(rec.normal).transform(vec3(d.x(), d.y(), z));
 
-            return true;
+            srec.scattered = Ray(rec.p, direction, r_in.time());
+            srec.attenuation = m_texture->filtered(rec);
+            srec.pdf = z / pi;
+            srec.is_specular = false;
+            return srec.pdf > 0;
+        }
+
+        bool isSpecular() const override {
+            return false;
+        }
+
+        color eval(const Ray& r_in, const Hit_Record& rec, const vec3& direction) const override {
+            double cosine = dot(unit_vector(direction), rec.normal);
+            return cosine > 0 ? m_texture->filtered(rec) * (cosine / pi) : color(0, 0, 0);
+        }
+
+        double pdf(const Ray& r_in, const Hit_Record& rec, const vec3& direction) const override {
+            double cosine = dot(unit_vector(direction), rec.normal);
+            return cosine > 0 ? cosine / pi : 0;
+        }
+
+        Material_Type type() const override {
+            return Material_Type::Lambertian;
         }
 
     private:
@@ -42,16 +156,32 @@ class Metal : public Material {
     public:
         Metal(const color& albedo, double fuzz = 0) : m_albedo(albedo), m_fuzz(fuzz < 1 ? fuzz : 1) {}
 
-        bool scatter( const Ray& r_in, const Hit_Record& rec, color& attenuation, Ray& scattered) const {
+        // The fuzzed reflection has no density worth evaluating, so it is treated as a delta lobe
+        bool sample(const Ray& r_in, const Hit_Record& rec, Sampler& sampler, Scatter_Record& srec) const override {
             auto scatter_direction = reflect(r_in.direction(), rec.normal);
-            vec3 fuzz_vec = random_unit_vector() * m_fuzz;
+            vec3 fuzz_vec = random_unit_vector(sampler) * m_fuzz;
             scatter_direction = unit_vector(scatter_direction) + fuzz_vec;
             if (scatter_direction.near_zero())
                 scatter_direction = rec.normal;
-            scattered = Ray(rec.p, scatter_direction, r_in.time());
-            attenuation = m_albedo;
 
-            return (dot(scattered.direction(), rec.normal) > 0);
+            srec.scattered = Ray(rec.p, scatter_direction, r_in.time());
+            srec.attenuation = m_albedo;
+            srec.pdf = 0;
+            srec.is_specular = true;
+            return (dot(scatter_direction, rec.normal) > 0);
+        }
+
+        // As for a perfect mirror, fuzz only moves the whole bundle
+        bool scatterDifferential(const Ray& r_in, const Ray_Differential& in, const Hit_Record& rec,
+                                 const Scatter_Record& srec, Ray_Differential& out) const override {
+            return specularDifferential(r_in, in, rec, srec.scattered, [](const vec3& d, const vec3& n, vec3& w) {
+                w = reflect(d, n);
+                return true;
+            }, out);
+        }
+
+        Material_Type type() const override {
+            return Material_Type::Metal;
         }
 
     private:
@@ -63,8 +193,10 @@ class Dielectric : public Material {
     public:
         Dielectric(double refraction_index) : m_refractionIndex(refraction_index) {}
 
-        bool scatter( const Ray& r_in, const Hit_Record& rec, color& attenuation, Ray& scattered) const {
-            attenuation = color(1.0, 1.0, 1.0);
+        bool sample(const Ray& r_in, const Hit_Record& rec, Sampler& sampler, Scatter_Record& srec) const override {
+            srec.attenuation = color(1.0, 1.0, 1.0);
+            srec.pdf = 0;
+            srec.is_specular = true;
 
             double ri = rec.front_face ? (1.0/m_refractionIndex) : m_refractionIndex;
 
@@ -74,15 +206,36 @@ class Dielectric : public Material {
             
             bool cannot_refract = sinTheta * ri > 1.0;
             vec3 direction;
-            if (cannot_refract || reflectance(cosTheta, ri) > random_double())
+            if (cannot_refract || reflectance(cosTheta, ri) > sampler.get1D())
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, ri);
 
-            scattered = Ray(rec.p, direction, r_in.time());
+            srec.scattered = Ray(rec.p, direction, r_in.time());
             return true;
         }
 
+        // Follows whichever of reflection and refraction sample() took. Offset rays that would be totally
+        // reflected where the main ray refracted end the differential.
+        bool scatterDifferential(const Ray& r_in, const Ray_Differential& in, const Hit_Record& rec,
+                                 const Scatter_Record& srec, Ray_Differential& out) const override {
+            if (dot(srec.scattered.direction(), rec.normal) > 0) {
+                return specularDifferential(r_in, in, rec, srec.scattered, [](const vec3& d, const vec3& n, vec3& w) {
+                    w = reflect(d, n);
+                    return true;
+                }, out);
+            }
+
+            double ri = rec.front_face ? (1.0/m_refractionIndex) : m_refractionIndex;
+            return specularDifferential(r_in, in, rec, srec.scattered, [ri](const vec3& d, const vec3& n, vec3& w) {
+                double cosTheta = fmin(dot(-d, n), 1.0);
+                if ((1 - cosTheta * cosTheta) * ri * ri > 1.0)
+                    return false;
+                w = refract(d, n, ri);
+                return true;
+            }, out);
+        }
+
         static double reflectance(double cosine, double refraction_index) {
             // Use Schlick's approximation for reflectance.
             auto r0 = (1 - refraction_index) / (1 + refraction_index);
@@ -90,6 +243,10 @@ class Dielectric : public Material {
             return r0 + (1-r0)*pow((1 - cosine),5);
         }
 
+        Material_Type type() const override {
+            return Material_Type::Dielectric;
+        }
+
     private:
         double m_refractionIndex;
 };
@@ -102,6 +259,14 @@ class Emissive : public Material {
         color emitted(double u, double v, const point3& p) const override {
             return m_tex->value(u, v, p);
         }
+
+        bool isEmissive() const override {
+            return true;
+        }
+        Material_Type type() const override {
+            return Material_Type::Emissive;
+        }
+
     private:
         shared_ptr<Texture> m_tex;
 };
@@ -111,12 +276,35 @@ class Isotropic : public Material {
         Isotropic(const color& albedo) : m_tex(make_shared<BasicTexture>(albedo)) {}
         Isotropic(shared_ptr<Texture> tex) : m_tex(tex) {}
 
-        bool scatter( const Ray& r_in, const Hit_Record& rec, color& attenuation, Ray& scattered) const {
-            scattered = Ray(rec.p, random_unit_vector(), r_in.time());
-            attenuation = m_tex->value(rec.u, rec.v, rec.p);
+        // Isotropic phase function, uniform over the sphere with density 1 / (4 pi)
+        bool sample(const Ray& r_in, const Hit_Record& rec, Sampler& sampler, Scatter_Record& srec) const override {
+            srec.scattered = Ray(rec.p, random_unit_vector(sampler), r_in.time());
+            srec.attenuation = m_tex->filtered(rec);
+            srec.pdf = 1 / (4 * pi);
+            srec.is_specular = false;
+            return true;
+        }
+
+        bool isSpecular() const override {
+            return false;
+        }
+
+        bool isVolumetric() const override {
             return true;
         }
 
+        color eval(const Ray& r_in, const Hit_Record& rec, const vec3& direction) const override {
+            return m_tex->filtered(rec) / (4 * pi);
+        }
+
+        double pdf(const Ray& r_in, const Hit_Record& rec, const vec3& direction) const override {
+            return 1 / (4 * pi);
+        }
+
+        Material_Type type() const override {
+            return Material_Type::Isotropic;
+        }
+
     private:
         shared_ptr<Texture> m_tex;
 };
@@ -0,0 +1,29 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "utilities.h"
+
+// Orthonormal basis with w along a given direction, for sampling directions around a normal or an axis
+class ONB {
+    public:
+        ONB(const vec3& n) {
+            m_axis[2] = unit_vector(n);
+            vec3 a = (std::fabs(m_axis[2].x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+            m_axis[1] = unit_vector(cross(m_axis[2], a));
+            m_axis[0] = cross(m_axis[2], m_axis[1]);
+        }
+
+        const vec3& u() const { return m_axis[0]; }
+        const vec3& v() const { return m_axis[1]; }
+        const vec3& w() const { return m_axis[2]; }
+
+        // From basis coordinates to world space
+        vec3 transform(const vec3& v) const {
+            return v[0] * m_axis[0] + v[1] * m_axis[1] + v[2] * m_axis[2];
+        }
+
+    private:
+        vec3 m_axis[3];
+};
+
+#endif
@@ -3,17 +3,36 @@
 
 #include "utilities.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+    Perlin gradient noise. noise() is the double precision reference. turb() runs the octaves four at a time
+    through noise4(), a single precision kernel that does the interpolation of the eight corners in SSE lanes,
+    one octave per lane. Cell coordinates and fractions are still found in double, so the float path does not
+    lose precision far from the origin.
+*/
 class Perlin {
 
     public:
-        Perlin() {
+        // Same seed, same noise, whatever else the program has drawn random numbers for
+        Perlin(uint64_t seed = 0) {
+            PCG32 rng(seed);
             for(int i = 0; i < POINT_COUNT; ++i) {
-                m_randVec[i] = unit_vector(random_double(-1, 1));
+                double x = -1 + 2 * rng.uniform();
+                double y = -1 + 2 * rng.uniform();
+                double z = -1 + 2 * rng.uniform();
+                m_randVec[i] = unit_vector(vec3(x, y, z));
+                m_grad[i][0] = float(m_randVec[i].x());
+                m_grad[i][1] = float(m_randVec[i].y());
+                m_grad[i][2] = float(m_randVec[i].z());
+                m_grad[i][3] = 0;
             }
 
-            perlinGeneratePerm(m_permX);
-            perlinGeneratePerm(m_permY);
-            perlinGeneratePerm(m_permZ);
+            perlinGeneratePerm(m_permX, rng);
+            perlinGeneratePerm(m_permY, rng);
+            perlinGeneratePerm(m_permZ, rng);
         }
 
         double noise(const point3& p) const {
@@ -41,20 +60,101 @@ class Perlin {
         }
 
         double turb(const point3& p, int depth) const {
+            return turb(p, depth, 0.0);
+        }
+
+        // turb() without the octaves whose features are finer than width, and the one at the cut faded out,
+        // so a footprint covering many of them does not alias. Width 0 keeps them all.
+        double turb(const point3& p, int depth, double width) const {
+            double octaves = width > 0 ? std::clamp(-1 - std::log2(width), 0.0, double(depth)) : depth;
+            int count = std::min(depth, int(std::ceil(octaves)));
+
             double accum = 0.0;
-            point3 temp_p = p;
-            double weight = 1.0;
-            while(depth > 0) {
-                accum += noise(temp_p) * weight;
-                weight *= 0.5;
-                temp_p *= 2;
-                --depth;
+            double frequency = 1.0;
+            for (int first = 0; first < count; first += 4) {
+                double pts[3][4];
+                float values[4];
+                int lanes = std::min(4, count - first);
+                double f = frequency;
+                for (int l = 0; l < 4; ++l) {
+                    pts[0][l] = p.x() * f;
+                    pts[1][l] = p.y() * f;
+                    pts[2][l] = p.z() * f;
+                    // Spare lanes repeat the last octave and are not added in
+                    if (l + 1 < lanes)
+                        f *= 2;
+                }
+                noise4(pts, values);
+
+                for (int l = 0; l < lanes; ++l) {
+                    double fade = std::min(octaves - (first + l), 1.0);
+                    accum += fade * values[l] / frequency;
+                    frequency *= 2;
+                }
             }
 
             return std::fabs(accum);
         }
 
+        // noise() at four points at once, in single precision. Without SSE it falls back to noise() per point.
+        void noise4(const double pts[3][4], float out[4]) const {
+#if defined(__SSE2__)
+            alignas(16) float frac[3][4];
+            int hashX[2][4], hashY[2][4], hashZ[2][4];  // Permutation entries of both cell faces per axis
+            for (int l = 0; l < 4; ++l) {
+                int i = fastFloor(pts[0][l]), j = fastFloor(pts[1][l]), k = fastFloor(pts[2][l]);
+                frac[0][l] = float(pts[0][l] - i);
+                frac[1][l] = float(pts[1][l] - j);
+                frac[2][l] = float(pts[2][l] - k);
+                hashX[0][l] = m_permX[i & 255];
+                hashX[1][l] = m_permX[(i + 1) & 255];
+                hashY[0][l] = m_permY[j & 255];
+                hashY[1][l] = m_permY[(j + 1) & 255];
+                hashZ[0][l] = m_permZ[k & 255];
+                hashZ[1][l] = m_permZ[(k + 1) & 255];
+            }
+
+            const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f);
+            __m128 f[3], fm1[3], smooth[3], rest[3];
+            for (int a = 0; a < 3; ++a) {
+                f[a] = _mm_load_ps(frac[a]);
+                fm1[a] = _mm_sub_ps(f[a], one);
+                // Hermite smoothing, t * t * (3 - 2 t)
+                smooth[a] = _mm_mul_ps(_mm_mul_ps(f[a], f[a]), _mm_sub_ps(three, _mm_mul_ps(two, f[a])));
+                rest[a] = _mm_sub_ps(one, smooth[a]);
+            }
+
+            __m128 accum = _mm_setzero_ps();
+            for (int c = 0; c < 8; ++c) {
+                int i = c >> 2, j = (c >> 1) & 1, k = c & 1;
+
+                // One (x, y, z, 0) load per lane, transposed into a register per component
+                __m128 g0 = _mm_load_ps(m_grad[hashX[i][0] ^ hashY[j][0] ^ hashZ[k][0]]);
+                __m128 g1 = _mm_load_ps(m_grad[hashX[i][1] ^ hashY[j][1] ^ hashZ[k][1]]);
+                __m128 g2 = _mm_load_ps(m_grad[hashX[i][2] ^ hashY[j][2] ^ hashZ[k][2]]);
+                __m128 g3 = _mm_load_ps(m_grad[hashX[i][3] ^ hashY[j][3] ^ hashZ[k][3]]);
+                _MM_TRANSPOSE4_PS(g0, g1, g2, g3);
+
+                __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g0, i ? fm1[0] : f[0]), _mm_mul_ps(g1, j ? fm1[1] : f[1])),
+                                        _mm_mul_ps(g2, k ? fm1[2] : f[2]));
+                __m128 weight = _mm_mul_ps(_mm_mul_ps(i ? smooth[0] : rest[0], j ? smooth[1] : rest[1]),
+                                           k ? smooth[2] : rest[2]);
+                accum = _mm_add_ps(accum, _mm_mul_ps(weight, dot));
+            }
+            _mm_storeu_ps(out, accum);
+#else
+            for (int l = 0; l < 4; ++l)
+                out[l] = float(noise(point3(pts[0][l], pts[1][l], pts[2][l])));
+#endif
+        }
+
     private:
+        // floor() for values in int range, without the library call when SSE4.1 rounding is not enabled
+        static int fastFloor(double x) {
+            int i = int(x);
+            return i - (x < i);
+        }
+
         static double perlinInterp(const vec3 c[2][2][2], double u, double v, double w) {
             auto uu = u*u*(3-2*u);
             auto vv = v*v*(3-2*v);
@@ -74,17 +174,17 @@ class Perlin {
             return accum;
         }
 
-        static void perlinGeneratePerm(int* p) {
+        static void perlinGeneratePerm(int* p, PCG32& rng) {
             for(int i = 0; i < POINT_COUNT; ++i) {
                 p[i] = i;
             }
 
-            permute(p, POINT_COUNT);
+            permute(p, POINT_COUNT, rng);
         }
 
-        static void permute(int* p, int pointCount) {
+        static void permute(int* p, int pointCount, PCG32& rng) {
             for (int i = pointCount-1; i > 0; i--) {
-                int target = random_int(0, i);
+                int target = int(rng.uniformBounded(uint32_t(i + 1)));
                 int tmp = p[i];
                 p[i] = p[target];
                 p[target] = tmp;
@@ -92,6 +192,7 @@ class Perlin {
         }
         static const int POINT_COUNT = 256;
         vec3 m_randVec[POINT_COUNT];
+        alignas(16) float m_grad[POINT_COUNT][4];  // m_randVec again as padded floats, one aligned load each
         int m_permX[POINT_COUNT];
         int m_permY[POINT_COUNT];
         int m_permZ[POINT_COUNT];
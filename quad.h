@@ -3,6 +3,7 @@
 
 #include "utilities.h"
 #include "hittable_list.h"
+#include "material.h"
 
 class Quad : public Hittable {
     public:
@@ -13,6 +14,7 @@ class Quad : public Hittable {
             m_normal = unit_vector(n);
             m_D = dot(m_normal, m_origin);
             m_w = n / dot(n, n);
+            m_area = n.length();
             setBoundingBox();
         }
 
@@ -26,28 +28,91 @@ class Quad : public Hittable {
         AABB getBoundingBox() const override { return m_aabb; }
 
         bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            if (!intersect(m_origin, m_u, m_v, m_normal, m_w, m_D, r, ray_t, rec))
+                return false;
+
+            rec.object = this;
+            return true;
+        }
+
+        void evaluate(const Ray& r, Hit_Record& rec) const override {
+            rec.p = r.at(rec.t);
+            rec.set_face_normal(r, m_normal);
+            rec.set_partials(m_u, m_v);
+            rec.mat = m_mat.get();
+        }
+
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            if (m_mat->isEmissive())
+                lights.push_back(this);
+        }
+
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            Hit_Record rec;
+            return intersect(m_origin, m_u, m_v, m_normal, m_w, m_D, r, ray_t, rec);
+        }
+
+        // Uniform over the area, so the solid angle density is distance^2 / (cos * area). Both faces count
+        double pdfValue(const Ray& r, const Interval& ray_t) const override {
+            Hit_Record rec;
+            if (!intersect(m_origin, m_u, m_v, m_normal, m_w, m_D, r, ray_t, rec))
+                return 0;
+
+            double dirLength = r.direction().length();
+            double distanceSquared = rec.t * rec.t * dirLength * dirLength;
+            double cosine = std::fabs(dot(r.direction(), m_normal)) / dirLength;
+            return distanceSquared / (cosine * m_area);
+        }
+
+        vec3 sampleDirection(const point3& origin, double time, const Sample2D& u) const override {
+            return m_origin + u.x * m_u + u.y * m_v - origin;
+        }
+
+        // A diffuse emitter on both faces, with its radiance averaged over a 4x4 grid of the texture
+        Light_Bounds lightBounds() const override {
+            color radiance(0, 0, 0);
+            for (int i = 0; i < 4; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    double a = (i + 0.5) / 4, b = (j + 0.5) / 4;
+                    radiance += m_mat->emitted(a, b, m_origin + a * m_u + b * m_v);
+                }
+            }
+            radiance /= 16;
+
+            Light_Bounds lb;
+            lb.bounds = m_aabb;
+            lb.w = m_normal;
+            lb.phi = 2 * pi * m_area * std::max(radiance.x(), std::max(radiance.y(), radiance.z()));
+            lb.cosTheta_o = 1;
+            lb.cosTheta_e = 0;
+            lb.twoSided = true;
+            return lb;
+        }
+
+        // Kernel shared with CompiledScene, which keeps quad data in flat arrays
+        static bool intersect(const point3& origin, const vec3& u, const vec3& v, const vec3& normal, const vec3& w,
+                              double D, const Ray& r, const Interval& ray_t, Hit_Record& rec) {
             vec3 dir = r.direction();
-            double nDotDir = dot(m_normal, dir);
+            double nDotDir = dot(normal, dir);
             if(fabs(nDotDir) < 1e-8)
                 return false;
 
             
-            double t = (m_D - dot(m_normal, r.origin()))/nDotDir;
+            double t = (D - dot(normal, r.origin()))/nDotDir;
             if(!ray_t.contains(t))
                 return false;
 
-            rec.p = r.at(t);
+            point3 intersection = r.at(t);
 
-            vec3 p = rec.p - m_origin;
-            double alpha = dot(m_w, cross(p, m_v));
-            double beta  = dot(m_w, cross(m_u, p));
+            vec3 p = intersection - origin;
+            double alpha = dot(w, cross(p, v));
+            double beta  = dot(w, cross(u, p));
             if(alpha < 0 || beta < 0 ||
                alpha > 1 || beta > 1)
                 return false;
 
+            // Only touch rec once we know this is a hit, callers pass in the record of their closest hit so far
             rec.t = t;
-            rec.mat = m_mat;
-            rec.set_face_normal(r, m_normal);
             rec.u = alpha;
             rec.v = beta;
 
@@ -55,12 +120,15 @@ class Quad : public Hittable {
         }
 
     private:
+        friend class CompiledScene;
+
         point3 m_origin;
         vec3 m_u, m_v;
         vec3 m_normal;
         vec3 m_w;
         //dot(normal, m_origin) = D
         double m_D;
+        double m_area;
         shared_ptr<Material> m_mat;
         AABB m_aabb;
 };
@@ -0,0 +1,62 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+    Stable parallel LSD radix sort of items by their uint64_t `code` member, 8 bits per pass over the low
+    keyBits bits. Each pass builds per-chunk histograms, prefix sums them digit major so equal digits keep their
+    order, then scatters every chunk in parallel. Passes where all items share a digit are skipped.
+*/
+template<typename T>
+void parallelRadixSort(std::vector<T>& items, ThreadPool& pool, int keyBits = 64) {
+    const int BITS = 8, BUCKETS = 1 << BITS;
+    const size_t CHUNK_SIZE = 16384;
+    size_t n = items.size();
+    int chunks = int((n + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    std::vector<T> scratch(n);
+    std::vector<size_t> offsets(size_t(chunks) * BUCKETS);
+
+    for (int shift = 0; shift < keyBits; shift += BITS) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        pool.parallelFor(chunks, [&](int c) {
+            size_t* hist = &offsets[size_t(c) * BUCKETS];
+            for (size_t i = size_t(c) * CHUNK_SIZE, end = std::min(n, i + CHUNK_SIZE); i < end; ++i)
+                ++hist[(items[i].code >> shift) & (BUCKETS - 1)];
+        });
+
+        // Skip passes where every code has the same digit
+        bool trivial = false;
+        for (int b = 0; b < BUCKETS && !trivial; ++b) {
+            size_t total = 0;
+            for (int c = 0; c < chunks; ++c)
+                total += offsets[size_t(c) * BUCKETS + b];
+            trivial = total == n;
+        }
+        if (trivial)
+            continue;
+
+        // Digit major, chunk minor prefix sum keeps the scatter stable
+        size_t running = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            for (int c = 0; c < chunks; ++c) {
+                size_t count = offsets[size_t(c) * BUCKETS + b];
+                offsets[size_t(c) * BUCKETS + b] = running;
+                running += count;
+            }
+        }
+
+        pool.parallelFor(chunks, [&](int c) {
+            size_t* next = &offsets[size_t(c) * BUCKETS];
+            for (size_t i = size_t(c) * CHUNK_SIZE, end = std::min(n, i + CHUNK_SIZE); i < end; ++i)
+                scratch[next[(items[i].code >> shift) & (BUCKETS - 1)]++] = items[i];
+        });
+        items.swap(scratch);
+    }
+}
+
+#endif
@@ -6,11 +6,15 @@
 class Ray {
     public:
         Ray () {};
-        Ray (const point3& origin, const vec3& direction, double time) : m_orig(origin), m_dir(direction), m_time(time) {};
-        Ray (const point3& origin, const vec3& direction) : m_orig(origin), m_dir(direction), m_time(0) {};
+        Ray (const point3& origin, const vec3& direction, double time) : m_orig(origin), m_dir(direction), m_time(time) {
+            m_invDir = vec3(1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2]);
+        };
+        Ray (const point3& origin, const vec3& direction) : Ray(origin, direction, 0) {};
 
         const point3& origin() const {return m_orig;}
         const vec3& direction() const {return m_dir;}
+        // 1/direction, computed once here so every AABB slab test along the ray can reuse it
+        const vec3& inv_direction() const {return m_invDir;}
         double time() const {return m_time;}
 
         point3 at(double t) const {
@@ -22,7 +26,18 @@ class Ray {
     private:
         point3 m_orig;
         vec3 m_dir;
+        vec3 m_invDir;
         double m_time;
 };
 
+/*
+    Ray differential (Igehy 1999): the rays through the neighbouring pixel sample positions in x and y, carried
+    beside the path's ray. Where they meet a surface tells how much of the texture one sample stands for.
+*/
+struct Ray_Differential {
+    bool valid = false;
+    point3 rxOrigin, ryOrigin;
+    vec3 rxDirection, ryDirection;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "utilities.h"
+#include "bvh_builder.h"
+
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/*
+    N coherent rays (4, 8 or 16) stored lane by lane. active marks the lanes that carry a ray, a partly
+    filled packet at the edge of a tile just leaves the rest off. tmax holds each lane's closest hit so far
+    and only shrinks, through shrink().
+
+    Node tests run in single precision, 4 lanes per SSE op or 8 per AVX op, with the same conservative
+    rounding as WideBVH: origins are nudged towards the near or far side of each slab and the far distance is
+    widened, so a node is never rejected for a lane whose double precision test would accept it.
+*/
+template<int N>
+struct alignas(32) RayPacket {
+    static_assert(N == 4 || N == 8 || N == 16, "Packets are 4, 8 or 16 rays wide");
+
+    double orig[3][N];
+    double dir[3][N];
+    double time[N];
+    double tmax[N];
+
+    float origNear[3][N];
+    float origFar[3][N];
+    float invDir[3][N];
+    int32_t negMask[3][N];  // All ones where the lane travels towards -axis
+    float tmaxF[N];         // tmax rounded up
+    uint32_t active;
+
+    RayPacket(const Ray* rays, int count, double tmax_init) {
+        active = (1u << count) - 1;
+        for (int k = 0; k < N; ++k) {
+            // Unused lanes copy lane 0 so every lane holds valid numbers
+            const Ray& r = rays[k < count ? k : 0];
+            for (int a = 0; a < 3; ++a) {
+                double o = r.origin()[a];
+                bool neg = r.inv_direction()[a] < 0;
+                float err = float(std::fabs(o)) * 1.1920929e-07f;
+                orig[a][k] = o;
+                dir[a][k] = r.direction()[a];
+                invDir[a][k] = float(r.inv_direction()[a]);
+                negMask[a][k] = neg ? -1 : 0;
+                origNear[a][k] = float(o) + (neg ? -err : err);
+                origFar[a][k]  = float(o) + (neg ? err : -err);
+            }
+            time[k] = r.time();
+            tmax[k] = tmax_init;
+            tmaxF[k] = LinearBVHNode::roundUp(tmax_init);
+        }
+    }
+
+    void shrink(int lane, double t) {
+        tmax[lane] = t;
+        tmaxF[lane] = LinearBVHNode::roundUp(t);
+    }
+
+    bool dirIsNeg(int lane, int axis) const {
+        return negMask[axis][lane] != 0;
+    }
+
+    // Bit k is set when lane k overlaps the node before its current closest hit
+    uint32_t hitNode(const LinearBVHNode& node, double tmin) const {
+        float ftmin = LinearBVHNode::roundDown(tmin);
+        uint32_t mask = 0;
+#if defined(__AVX__)
+        if constexpr (N % 8 == 0) {
+            for (int k = 0; k < N; k += 8) {
+                __m256 tNear = _mm256_set1_ps(ftmin);
+                __m256 tFar  = _mm256_load_ps(&tmaxF[k]);
+                for (int a = 0; a < 3; ++a) {
+                    __m256 neg = _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)&negMask[a][k]));
+                    __m256 bmin = _mm256_set1_ps(node.boundsMin[a]), bmax = _mm256_set1_ps(node.boundsMax[a]);
+                    __m256 nearB = _mm256_blendv_ps(bmin, bmax, neg);
+                    __m256 farB  = _mm256_blendv_ps(bmax, bmin, neg);
+                    __m256 inv = _mm256_load_ps(&invDir[a][k]);
+                    // max/min return their second operand when the first is NaN, which keeps NaN slabs harmless
+                    tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearB, _mm256_load_ps(&origNear[a][k])), inv), tNear);
+                    tFar  = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farB, _mm256_load_ps(&origFar[a][k])), inv), tFar);
+                }
+                tFar = _mm256_mul_ps(tFar, _mm256_set1_ps(FAR_SCALE));
+                mask |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ))) << k;
+            }
+            return mask & active;
+        }
+#endif
+#if defined(__SSE2__)
+        for (int k = 0; k < N; k += 4) {
+            __m128 tNear = _mm_set1_ps(ftmin);
+            __m128 tFar  = _mm_load_ps(&tmaxF[k]);
+            for (int a = 0; a < 3; ++a) {
+                __m128 neg = _mm_castsi128_ps(_mm_load_si128((const __m128i*)&negMask[a][k]));
+                __m128 bmin = _mm_set1_ps(node.boundsMin[a]), bmax = _mm_set1_ps(node.boundsMax[a]);
+                __m128 nearB = _mm_or_ps(_mm_and_ps(neg, bmax), _mm_andnot_ps(neg, bmin));
+                __m128 farB  = _mm_or_ps(_mm_and_ps(neg, bmin), _mm_andnot_ps(neg, bmax));
+                __m128 inv = _mm_load_ps(&invDir[a][k]);
+                // max/min return their second operand when the first is NaN, which keeps NaN slabs harmless
+                tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearB, _mm_load_ps(&origNear[a][k])), inv), tNear);
+                tFar  = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farB, _mm_load_ps(&origFar[a][k])), inv), tFar);
+            }
+            tFar = _mm_mul_ps(tFar, _mm_set1_ps(FAR_SCALE));
+            mask |= uint32_t(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar))) << k;
+        }
+        return mask & active;
+#else
+        for (int k = 0; k < N; ++k) {
+            float tNear = ftmin, tFar = tmaxF[k];
+            for (int a = 0; a < 3; ++a) {
+                float nearB = negMask[a][k] ? node.boundsMax[a] : node.boundsMin[a];
+                float farB  = negMask[a][k] ? node.boundsMin[a] : node.boundsMax[a];
+                float t0 = (nearB - origNear[a][k]) * invDir[a][k];
+                float t1 = (farB - origFar[a][k]) * invDir[a][k];
+                tNear = t0 > tNear ? t0 : tNear;
+                tFar  = t1 < tFar ? t1 : tFar;
+            }
+            mask |= uint32_t(tNear <= tFar * FAR_SCALE) << k;
+        }
+        return mask & active;
+#endif
+    }
+
+    // Widens the far distance to cover float rounding in the slab test (pbrt's 1 + 2 * gamma(3))
+    static constexpr float FAR_SCALE = 1.0f + 2.0f * (3 * 5.96046448e-08f) / (1 - 3 * 5.96046448e-08f);
+};
+
+#endif
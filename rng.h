@@ -0,0 +1,104 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+#include <cstring>
+
+// Finalizer of MurmurHash3, spreads every input bit over the whole word
+inline uint64_t mixBits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+inline uint64_t hashCombine(uint64_t a, uint64_t b) {
+    return mixBits(a ^ mixBits(b + 0x9e3779b97f4a7c15ull));
+}
+
+inline uint64_t hashDouble(double d) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    return mixBits(bits);
+}
+
+// Two uniform numbers in [0,1), such as a sampler's 2D dimension
+struct Sample2D {
+    double x, y;
+};
+
+/*
+    O'Neill's PCG32 (XSH RR output on a 64 bit LCG). Every (sequence, position) pair names one number, and
+    advance() jumps to any position in O(log n) steps, so a stream can be keyed by what it is used for, such
+    as a pixel, a sample index and a dimension, instead of by whichever thread happens to run it. Renders are
+    then bit identical for any thread count or tile order.
+*/
+class PCG32 {
+    public:
+        PCG32() : m_state(DEFAULT_STATE), m_inc(DEFAULT_STREAM) {}
+        PCG32(uint64_t sequence, uint64_t seed) {
+            setSequence(sequence, seed);
+        }
+        explicit PCG32(uint64_t sequence) : PCG32(sequence, mixBits(sequence)) {}
+
+        void setSequence(uint64_t sequence, uint64_t seed) {
+            m_state = 0u;
+            m_inc = (sequence << 1u) | 1u;
+            uniformUInt32();
+            m_state += seed;
+            uniformUInt32();
+        }
+
+        void setSequence(uint64_t sequence) {
+            setSequence(sequence, mixBits(sequence));
+        }
+
+        uint32_t uniformUInt32() {
+            uint64_t old = m_state;
+            m_state = old * MULT + m_inc;
+            uint32_t xorShifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+            uint32_t rot = uint32_t(old >> 59u);
+            return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+        }
+
+        // Uniform in [0,1)
+        double uniform() {
+            return uniformUInt32() * 0x1p-32;
+        }
+
+        // Uniform in [0, bound), without modulo bias
+        uint32_t uniformBounded(uint32_t bound) {
+            uint32_t threshold = (~bound + 1u) % bound;
+            while (true) {
+                uint32_t r = uniformUInt32();
+                if (r >= threshold)
+                    return r % bound;
+            }
+        }
+
+        // Skips delta numbers ahead, Brown's method for jumping an LCG
+        void advance(uint64_t delta) {
+            uint64_t curMult = MULT, curPlus = m_inc, accMult = 1u, accPlus = 0u;
+            while (delta > 0) {
+                if (delta & 1) {
+                    accMult *= curMult;
+                    accPlus = accPlus * curMult + curPlus;
+                }
+                curPlus = (curMult + 1) * curPlus;
+                curMult *= curMult;
+                delta /= 2;
+            }
+            m_state = accMult * m_state + accPlus;
+        }
+
+    private:
+        static constexpr uint64_t DEFAULT_STATE = 0x853c49e6748fea9bull;
+        static constexpr uint64_t DEFAULT_STREAM = 0xda3e39cb94b95bdbull;
+        static constexpr uint64_t MULT = 0x5851f42d4c957f2dull;
+
+        uint64_t m_state, m_inc;
+};
+
+#endif
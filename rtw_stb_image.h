@@ -11,42 +11,55 @@
 #include "external/stb_image.h"
 
 #include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <string>
 
 class rtw_image {
   public:
     rtw_image() {}
 
     rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
-
-        auto filename = std::string(image_filename);
-        auto imagedir = getenv("RTW_IMAGES");
+        // Loads image data from the specified file, found by resolve(). If the image was not loaded
+        // successfully, width() and height() will return 0.
 
-        // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
+        auto path = resolve(image_filename);
+        if (!path.empty() && load(path)) return;
 
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
+    static std::string resolve(const std::string& filename) {
+        // Returns where the image file is, or an empty string. If the RTW_IMAGES environment variable
+        // is defined, looks in that directory first. Then searches from the current directory, then
+        // in the images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
+        // parent, on so on, for six levels up. Only checks that files exist, nothing is decoded.
+
+        auto found = [](const std::string& candidate) {
+            std::error_code error;
+            return std::filesystem::is_regular_file(candidate, error);
+        };
+
+        auto imagedir = getenv("RTW_IMAGES");
+        if (imagedir && found(std::string(imagedir) + "/" + filename)) return std::string(imagedir) + "/" + filename;
+
+        std::string candidate = filename;
+        if (found(candidate)) return candidate;
+        std::string prefix = "images/";
+        for (int up = 0; up <= 6; up++, prefix = "../" + prefix) {
+            candidate = prefix + filename;
+            if (found(candidate)) return candidate;
+        }
+        return "";
+    }
+
     ~rtw_image() {
-        delete[] bdata;
         STBI_FREE(fdata);
     }
 
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
     bool load(const std::string& filename) {
         // Loads the linear (gamma=1) image data from the given file name. Returns true if the
         // load succeeded. The resulting data buffer contains the three [0.0, 1.0]
@@ -58,33 +71,35 @@ class rtw_image {
         fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
         if (fdata == nullptr) return false;
 
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        path = filename;
         return true;
     }
 
+    // The candidate location the image was found at, empty if it was not
+    const std::string& resolved_path() const { return path; }
+
     int width()  const { return (fdata == nullptr) ? 0 : image_width; }
     int height() const { return (fdata == nullptr) ? 0 : image_height; }
 
-    const unsigned char* pixel_data(int x, int y) const {
-        // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
-        // data, returns magenta.
-        static unsigned char magenta[] = { 255, 0, 255 };
-        if (bdata == nullptr) return magenta;
+    const float* pixel_data(int x, int y) const {
+        // Return the address of the three linear RGB floats of the pixel at x,y. If there is no
+        // image data, returns magenta. Only the float data is kept, texture lookups go through
+        // the tiled copy in the texture cache.
+        static float magenta[] = { 1, 0, 1 };
+        if (fdata == nullptr) return magenta;
 
         x = clamp(x, 0, image_width);
         y = clamp(y, 0, image_height);
 
-        return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
+        return fdata + (size_t(y)*image_width + x)*bytes_per_pixel;
     }
 
   private:
     const int      bytes_per_pixel = 3;
     float         *fdata = nullptr;         // Linear floating point pixel data
-    unsigned char *bdata = nullptr;         // Linear 8-bit pixel data
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
-    int            bytes_per_scanline = 0;
+    std::string    path;
 
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
@@ -92,30 +107,6 @@ class rtw_image {
         if (x < high) return x;
         return high - 1;
     }
-
-    static unsigned char float_to_byte(float value) {
-        if (value <= 0.0)
-            return 0;
-        if (1.0 <= value)
-            return 255;
-        return static_cast<unsigned char>(256.0 * value);
-    }
-
-    void convert_to_bytes() {
-        // Convert the linear floating point pixel data to bytes, storing the resulting byte
-        // data in the `bdata` member.
-
-        int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
-
-        // Iterate through all pixel components, converting from [0.0, 1.0] float values to
-        // unsigned [0, 255] byte values.
-
-        auto *bptr = bdata;
-        auto *fptr = fdata;
-        for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
-            *bptr = float_to_byte(*fptr);
-    }
 };
 
 // Restore MSVC compiler warnings
@@ -0,0 +1,405 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "utilities.h"
+#include "rng.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+    Samplers hand out the random numbers of one camera sample, dimension by dimension. The camera starts
+    every sample with startPixelSample(), then takes the pixel position, lens position and time from the first
+    dimensions. Each bounce takes the next block. Because a given dimension always means the same thing, a
+    low discrepancy sampler can spread the samples of a pixel evenly over every decision on the path, not just
+    over the pixel area.
+
+    Samplers carry per sample state, so every render thread uses its own, made by makeSampler().
+*/
+enum class SamplerType {
+    Independent,  // Plain uniform random numbers
+    Stratified,   // Jittered strata, shuffled independently per pixel and dimension
+    Sobol,        // Owen scrambled Sobol points, scrambled per pixel and dimension
+    BlueNoise     // One Sobol sequence for the whole image, rotated per pixel by a blue noise mask
+};
+
+class Sampler {
+    public:
+        virtual ~Sampler() = default;
+
+        // Renders with different seeds are independent, so they can be averaged
+        void setSeed(uint64_t seed) {
+            m_seed = seed;
+        }
+
+        void startPixelSample(int x, int y, int index, int dimension = 0) {
+            m_x = x;
+            m_y = y;
+            m_index = uint32_t(index);
+            m_dimension = dimension;
+            m_pixelSeed = hashCombine(m_seed, uint64_t(uint32_t(x)) << 32 | uint32_t(y));
+        }
+
+        int dimension() const {
+            return m_dimension;
+        }
+
+        void setDimension(int dimension) {
+            m_dimension = dimension;
+        }
+
+        virtual double get1D() = 0;
+        virtual Sample2D get2D() = 0;
+
+        // Maps 32 random bits to [0,1)
+        static double toUnit(uint32_t bits) {
+            return bits * 0x1p-32;
+        }
+
+    protected:
+        int m_x = 0, m_y = 0;
+        uint32_t m_index = 0;
+        int m_dimension = 0;
+        uint64_t m_pixelSeed = 0;
+        uint64_t m_seed = 0;
+};
+
+// Plain uniform numbers. Each (pixel, sample, dimension) is its own position in a PCG32 stream per pixel,
+// so a sample comes out the same whichever thread draws it and however many dimensions came before it
+class Independent_Sampler : public Sampler {
+    public:
+        double get1D() override {
+            seek();
+            ++m_dimension;
+            ++m_rngDimension;
+            return m_rng.uniform();
+        }
+
+        Sample2D get2D() override {
+            seek();
+            m_dimension += 2;
+            m_rngDimension += 2;
+            double x = m_rng.uniform();
+            return Sample2D{ x, m_rng.uniform() };
+        }
+
+    private:
+        // Dimensions per sample before the stream would run into the next sample's numbers
+        static constexpr uint64_t SAMPLE_STRIDE = 1ull << 16;
+
+        void seek() {
+            if (m_rngPixel == m_pixelSeed && m_rngIndex == m_index && m_rngDimension == m_dimension)
+                return;
+            m_rng.setSequence(m_pixelSeed);
+            m_rng.advance(uint64_t(m_index) * SAMPLE_STRIDE + uint64_t(m_dimension));
+            m_rngPixel = m_pixelSeed;
+            m_rngIndex = m_index;
+            m_rngDimension = m_dimension;
+        }
+
+        PCG32 m_rng;
+        uint64_t m_rngPixel = 0;
+        uint32_t m_rngIndex = 0;
+        int m_rngDimension = -1;
+};
+
+/*
+    1D dimensions split [0,1) into samples_per_pixel strata, 2D dimensions use an n x n grid with n the
+    square root of samples_per_pixel rounded down. Sample i of a pixel lands in a randomly permuted stratum
+    and is jittered inside it. Once a pixel runs past the strata count (adaptive sampling, or spp that is not
+    a square) the next round gets a fresh permutation, so each sample on its own is still uniform.
+*/
+class Stratified_Sampler : public Sampler {
+    public:
+        Stratified_Sampler(int samples_per_pixel)
+            : m_strata1D(uint32_t(std::max(1, samples_per_pixel))),
+              m_side(uint32_t(std::max(1.0, std::floor(std::sqrt(double(std::max(1, samples_per_pixel))))))) {}
+
+        double get1D() override {
+            uint64_t seed = hashCombine(m_pixelSeed, uint64_t(m_dimension++));
+            uint32_t round = m_index / m_strata1D;
+            uint32_t stratum = permute(m_index % m_strata1D, m_strata1D, uint32_t(hashCombine(seed, round)));
+            double jitter = toUnit(uint32_t(hashCombine(seed, m_index) >> 32));
+            return (stratum + jitter) / m_strata1D;
+        }
+
+        Sample2D get2D() override {
+            uint64_t seed = hashCombine(m_pixelSeed, uint64_t(m_dimension));
+            m_dimension += 2;
+            uint32_t strata = m_side * m_side;
+            uint32_t round = m_index / strata;
+            uint32_t stratum = permute(m_index % strata, strata, uint32_t(hashCombine(seed, round)));
+            uint64_t jitter = hashCombine(seed, m_index);
+            return Sample2D{ (stratum % m_side + toUnit(uint32_t(jitter))) / m_side,
+                             (stratum / m_side + toUnit(uint32_t(jitter >> 32))) / m_side };
+        }
+
+        // Kensler's hashed permutation: element i of a random permutation of [0, l), without storing it
+        static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+            if (l <= 1)
+                return 0;
+            uint32_t w = l - 1;
+            w |= w >> 1;
+            w |= w >> 2;
+            w |= w >> 4;
+            w |= w >> 8;
+            w |= w >> 16;
+            do {
+                i ^= p;
+                i *= 0xe170893d;
+                i ^= p >> 16;
+                i ^= (i & w) >> 4;
+                i ^= p >> 8;
+                i *= 0x0929eb3f;
+                i ^= p >> 23;
+                i ^= (i & w) >> 1;
+                i *= 1 | p >> 27;
+                i *= 0x6935fa69;
+                i ^= (i & w) >> 11;
+                i *= 0x74dcb303;
+                i ^= (i & w) >> 2;
+                i *= 0x9e501cc3;
+                i ^= (i & w) >> 2;
+                i *= 0xc860a3df;
+                i &= w;
+                i ^= i >> 5;
+            } while (i >= l);
+            return (i + p) % l;
+        }
+
+    private:
+        uint32_t m_strata1D;
+        uint32_t m_side;
+};
+
+/*
+    Owen scrambled Sobol points after Burley, "Practical Hash-based Owen Scrambling" (JCGT 2020). Every
+    dimension (or pair, for get2D) uses the first two Sobol dimensions with its own index shuffle and its own
+    nested uniform scramble, both seeded from the pixel and dimension. The shuffle decorrelates dimensions
+    from each other, the scramble keeps the stratification of the points while making each of them uniformly
+    distributed, so any prefix of a pixel's samples stays well spread and the estimate stays unbiased.
+*/
+class Sobol_Sampler : public Sampler {
+    public:
+        double get1D() override {
+            uint64_t seed = hashCombine(m_pixelSeed, uint64_t(m_dimension++));
+            return toUnit(sobol1D(m_index, seed));
+        }
+
+        Sample2D get2D() override {
+            uint64_t seed = hashCombine(m_pixelSeed, uint64_t(m_dimension));
+            m_dimension += 2;
+            uint32_t x, y;
+            sobol2D(m_index, seed, x, y);
+            return Sample2D{ toUnit(x), toUnit(y) };
+        }
+
+        // Sobol dimension 0 is the bit reversed index, so its scramble skips the reversal in and out
+        static uint32_t sobol1D(uint32_t index, uint64_t seed) {
+            uint32_t i = nestedUniformScramble(index, uint32_t(seed));
+            return reverseBits(laineKarras(i, uint32_t(seed >> 32)));
+        }
+
+        static void sobol2D(uint32_t index, uint64_t seed, uint32_t& x, uint32_t& y) {
+            uint32_t i = nestedUniformScramble(index, uint32_t(seed));
+            x = reverseBits(laineKarras(i, uint32_t(seed >> 32)));
+            y = nestedUniformScramble(sobolSecondDimension(i), uint32_t(mixBits(seed)));
+        }
+
+        // Dimension 1 of the Sobol sequence (dimension 0 is the bit reversed index). The shuffled index uses
+        // all 32 bits, so the XOR of direction numbers is looked up a byte at a time instead of bit by bit
+        static uint32_t sobolSecondDimension(uint32_t index) {
+            static const std::vector<uint32_t> table = [] {
+                std::vector<uint32_t> t(4 * 256);
+                uint32_t v = 1u << 31;
+                for (int bit = 0; bit < 32; ++bit, v ^= v >> 1) {
+                    int byte = bit / 8;
+                    for (int entry = 0; entry < 256; ++entry)
+                        if (entry >> (bit % 8) & 1)
+                            t[byte * 256 + entry] ^= v;
+                }
+                return t;
+            }();
+            return table[index & 0xff] ^ table[256 + (index >> 8 & 0xff)] ^
+                   table[512 + (index >> 16 & 0xff)] ^ table[768 + (index >> 24)];
+        }
+
+        static uint32_t reverseBits(uint32_t v) {
+#if defined(__GNUC__)
+            v = __builtin_bswap32(v);
+#else
+            v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+            v = (v >> 16) | (v << 16);
+#endif
+            v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+            v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+            return ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+        }
+
+        // Hash where every bit only depends on the bits below it. Applied to reversed bits it is exactly an
+        // Owen scramble of the original ones
+        static uint32_t laineKarras(uint32_t v, uint32_t seed) {
+            v += seed;
+            v ^= v * 0x6c50b47cu;
+            v ^= v * 0xb82f1e52u;
+            v ^= v * 0xc7afe638u;
+            v ^= v * 0x8d22f6e6u;
+            return v;
+        }
+
+        static uint32_t nestedUniformScramble(uint32_t v, uint32_t seed) {
+            return reverseBits(laineKarras(reverseBits(v), seed));
+        }
+};
+
+/*
+    Every pixel takes the same scrambled Sobol sequence, shifted (Cranley-Patterson rotation) by the value of
+    a tileable blue noise mask at the pixel. Each dimension reads the mask at its own fixed offset. Neighbouring
+    pixels then get very different shifts, which pushes the remaining error to high frequencies where it
+    reads as fine grain instead of blotches, and is much easier to filter or to miss.
+*/
+class Blue_Noise_Sampler : public Sampler {
+    public:
+        static constexpr int MASK_SIZE = 64;
+
+        double get1D() override {
+            int d = m_dimension++;
+            uint64_t seed = hashCombine(m_seed, uint64_t(d));
+            return rotate(toUnit(Sobol_Sampler::sobol1D(m_index, seed)), mask(d));
+        }
+
+        Sample2D get2D() override {
+            int d = m_dimension;
+            m_dimension += 2;
+            uint32_t x, y;
+            Sobol_Sampler::sobol2D(m_index, hashCombine(m_seed, uint64_t(d)), x, y);
+            return Sample2D{ rotate(toUnit(x), mask(d)), rotate(toUnit(y), mask(d + 1)) };
+        }
+
+        // Ranks of a 64 x 64 void and cluster pattern, scaled to [0,1). Built once on first use
+        static const std::vector<float>& blueNoiseMask() {
+            static const std::vector<float> mask = buildVoidAndCluster(MASK_SIZE, 1.5);
+            return mask;
+        }
+
+    private:
+        double mask(int dimension) const {
+            uint64_t offset = hashCombine(0xb1a5eull, uint64_t(dimension));
+            int x = (m_x + int(offset)) & (MASK_SIZE - 1);
+            int y = (m_y + int(offset >> 32)) & (MASK_SIZE - 1);
+            return blueNoiseMask()[size_t(y) * MASK_SIZE + x];
+        }
+
+        static double rotate(double value, double shift) {
+            value += shift;
+            return value < 1 ? value : value - 1;
+        }
+
+        /*
+            Ulichney's void and cluster method on a size x size torus. Energy is the sum of a Gaussian over the
+            set pixels. Starting from a random sparse pattern, tightest clusters are swapped into the largest voids
+            until the pattern is stable. Then the pattern's pixels are ranked by removing the tightest cluster
+            one at a time, and the empty pixels by filling the largest void one at a time. Filling the largest
+            void also covers the usual third phase, since the Gaussian sums to a constant over the torus.
+        */
+        static std::vector<float> buildVoidAndCluster(int size, double sigma) {
+            const int n = size * size;
+            std::vector<double> kernel(n);
+            for (int dy = 0; dy < size; ++dy) {
+                for (int dx = 0; dx < size; ++dx) {
+                    int wx = std::min(dx, size - dx), wy = std::min(dy, size - dy);
+                    kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+                }
+            }
+
+            std::vector<char> pattern(n, 0);
+            std::vector<double> energy(n, 0.0);
+            auto splat = [&](int p, double sign) {
+                int px = p % size, py = p / size;
+                for (int y = 0; y < size; ++y) {
+                    int ky = ((y - py + size) % size) * size;
+                    for (int x = 0; x < size; ++x)
+                        energy[y * size + x] += sign * kernel[ky + (x - px + size) % size];
+                }
+            };
+            auto tightestCluster = [&]() {
+                int best = -1;
+                for (int p = 0; p < n; ++p)
+                    if (pattern[p] && (best < 0 || energy[p] > energy[best]))
+                        best = p;
+                return best;
+            };
+            auto largestVoid = [&]() {
+                int best = -1;
+                for (int p = 0; p < n; ++p)
+                    if (!pattern[p] && (best < 0 || energy[p] < energy[best]))
+                        best = p;
+                return best;
+            };
+
+            // Initial pattern, about a tenth of the pixels
+            int ones = 0;
+            for (int p = 0; p < n; ++p) {
+                if (mixBits(uint64_t(p) + 0xc0ffeeull) % 10 == 0) {
+                    pattern[p] = 1;
+                    splat(p, 1);
+                    ++ones;
+                }
+            }
+            for (int iter = 0; iter < n; ++iter) {
+                int cluster = tightestCluster();
+                pattern[cluster] = 0;
+                splat(cluster, -1);
+                int gap = largestVoid();
+                pattern[gap] = 1;
+                splat(gap, 1);
+                if (gap == cluster)
+                    break;
+            }
+
+            std::vector<int> rank(n, 0);
+            std::vector<char> initial = pattern;
+            std::vector<double> initialEnergy = energy;
+            for (int r = ones - 1; r >= 0; --r) {
+                int cluster = tightestCluster();
+                pattern[cluster] = 0;
+                splat(cluster, -1);
+                rank[cluster] = r;
+            }
+
+            pattern = initial;
+            energy = initialEnergy;
+            for (int r = ones; r < n; ++r) {
+                int gap = largestVoid();
+                pattern[gap] = 1;
+                splat(gap, 1);
+                rank[gap] = r;
+            }
+
+            std::vector<float> mask(n);
+            for (int p = 0; p < n; ++p)
+                mask[p] = (rank[p] + 0.5f) / n;
+            return mask;
+        }
+};
+
+// Uniform direction from the sampler's next 2D dimension
+inline vec3 random_unit_vector(Sampler& sampler) {
+    Sample2D u = sampler.get2D();
+    return sample_unit_sphere(u.x, u.y);
+}
+
+inline std::unique_ptr<Sampler> makeSampler(SamplerType type, int samples_per_pixel, uint64_t seed = 0) {
+    std::unique_ptr<Sampler> sampler;
+    switch (type) {
+        case SamplerType::Stratified: sampler = std::make_unique<Stratified_Sampler>(samples_per_pixel); break;
+        case SamplerType::Sobol:      sampler = std::make_unique<Sobol_Sampler>(); break;
+        case SamplerType::BlueNoise:  sampler = std::make_unique<Blue_Noise_Sampler>(); break;
+        default:                      sampler = std::make_unique<Independent_Sampler>(); break;
+    }
+    sampler->setSeed(seed);
+    return sampler;
+}
+
+#endif
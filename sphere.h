@@ -3,6 +3,8 @@
 
 #include "hittable.h"
 #include "utilities.h"
+#include "material.h"
+#include "onb.h"
  
 class Sphere : public Hittable {
     public:
@@ -20,11 +22,95 @@ class Sphere : public Hittable {
         };
 
         bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
-            vec3 center = getSphereCenter(r.time());
+            if (!intersect(getSphereCenter(r.time()), m_radius, r, ray_t, rec.t))
+                return false;
+
+            rec.object = this;
+            return true;
+        }
+
+        void evaluate(const Ray& r, Hit_Record& rec) const override {
+            evaluateSurface(getSphereCenter(r.time()), m_radius, r, rec);
+            rec.mat = m_mat.get();
+        }
+
+        AABB getBoundingBox() const override {
+            return m_aabb;
+        }
+
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            double t;
+            return intersect(getSphereCenter(r.time()), m_radius, r, ray_t, t);
+        }
+
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            if (m_mat->isEmissive())
+                lights.push_back(this);
+        }
+
+        // Samples the cone of directions the sphere covers as seen from the origin, uniformly by solid angle.
+        // From inside the sphere every direction hits it, so those are uniform over the whole sphere.
+        double pdfValue(const Ray& r, const Interval& ray_t) const override {
+            point3 center = getSphereCenter(r.time());
+            double t;
+            if (!intersect(center, m_radius, r, ray_t, t))
+                return 0;
+
+            double distanceSquared = (center - r.origin()).length_squared();
+            if (distanceSquared <= m_radius * m_radius)
+                return 1 / (4 * pi);
+            return 1 / (2 * pi * oneMinusCosThetaMax(distanceSquared));
+        }
+
+        vec3 sampleDirection(const point3& origin, double time, const Sample2D& u) const override {
+            point3 center = getSphereCenter(time);
+            vec3 toCenter = center - origin;
+            double distanceSquared = toCenter.length_squared();
+            vec3 direction;
+            if (distanceSquared <= m_radius * m_radius) {
+                direction = sample_unit_sphere(u.x, u.y);
+            } else {
+                double z = 1 - u.x * oneMinusCosThetaMax(distanceSquared);
+                double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+                double phi = 2 * pi * u.y;
+                direction = ONB(toCenter).transform(vec3(r * std::cos(phi), r * std::sin(phi), z));
+            }
+
+            // Scale to the first point the direction reaches. Directions at the rim of the cone can miss by
+            // rounding, they take the closest point along the ray, which is where the rim touches it.
+            double t;
+            if (!intersect(center, m_radius, Ray(origin, direction, time), Interval(0, infinity), t))
+                t = dot(direction, toCenter);
+            return direction * t;
+        }
+
+        // Normals point everywhere. Radiance is averaged over 16 stratified points of the surface
+        Light_Bounds lightBounds() const override {
+            color radiance(0, 0, 0);
+            for (int i = 0; i < 4; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    vec3 n = sample_unit_sphere((i + 0.5) / 4, (j + 0.5) / 4);
+                    double u, v;
+                    getSphereUV(n, u, v);
+                    radiance += m_mat->emitted(u, v, m_center0 + m_radius * n);
+                }
+            }
+            radiance /= 16;
+
+            Light_Bounds lb;
+            lb.bounds = m_aabb;
+            lb.phi = 4 * pi * pi * m_radius * m_radius * std::max(radiance.x(), std::max(radiance.y(), radiance.z()));
+            lb.cosTheta_o = -1;
+            lb.cosTheta_e = 0;
+            return lb;
+        }
+
+        // Kernels shared with CompiledScene, which keeps sphere data in flat arrays
+        static bool intersect(const point3& center, double radius, const Ray& r, const Interval& ray_t, double& t) {
             vec3 oc = center - r.origin();
             double a = r.direction().length_squared();
             double h = dot(r.direction(), oc);
-            double c = oc.length_squared() - m_radius * m_radius;
+            double c = oc.length_squared() - radius * radius;
 
             double det = h*h - a * c;
             if (det < 0.0)
@@ -42,21 +128,28 @@ class Sphere : public Hittable {
                     root = t2;
             } 
 
-            rec.t = root;
+            t = root;
+            return true;
+        }
+
+        static void evaluateSurface(const point3& center, double radius, const Ray& r, Hit_Record& rec) {
             rec.p = r.at(rec.t);
-            vec3 out_norm = (rec.p - center)/m_radius;
+            vec3 out_norm = (rec.p - center)/radius;
             getSphereUV(out_norm, rec.u, rec.v);
             rec.set_face_normal(r, out_norm);
-            rec.mat = m_mat;
 
-            return true;
-        }
-
-        AABB getBoundingBox() const override {
-            return m_aabb;
+            // From getSphereUV()'s angles, phi = 2 pi u and theta = pi v, on the unit sphere and then scaled
+            const vec3& n = out_norm;
+            double sinTheta = std::max(std::sqrt(n.x() * n.x() + n.z() * n.z()), 1e-8);
+            vec3 dndu = 2 * pi * vec3(n.z(), 0, -n.x());
+            vec3 dndv = pi * vec3(-n.y() * n.x() / sinTheta, sinTheta, -n.y() * n.z() / sinTheta);
+            double side = rec.front_face ? 1 : -1;
+            rec.set_partials(radius * dndu, radius * dndv, side * dndu, side * dndv);
         }
 
     private:
+        friend class CompiledScene;
+
         point3 getSphereCenter(double time) const {
             if (!m_isMoving)
                 return m_center0;
@@ -64,6 +157,12 @@ class Sphere : public Hittable {
             return m_center0 + m_centerVec * time;
         }
 
+        // 1 - cos of the cone's half angle, written so it keeps its precision for small, distant spheres
+        double oneMinusCosThetaMax(double distanceSquared) const {
+            double sinSquared = m_radius * m_radius / distanceSquared;
+            return sinSquared / (1 + std::sqrt(1 - sinSquared));
+        }
+
         static void getSphereUV(const point3& p, double& u, double& v) {
             auto theta = std::acos(-p.y());
             auto phi = std::atan2(-p.z(), p.x()) + pi;
@@ -0,0 +1,60 @@
+#include "../utilities.h"
+
+#include "../hittable_list.h"
+#include "../sphere.h"
+#include "../material.h"
+
+#include <vector>
+
+/*
+    Checks that nested Transforms folded at construction agree with the same wrappers applied one at a time,
+    and exits non-zero when they do not. Each unfolded layer is hidden in a Hittable_List so the next wrapper
+    cannot see through it. Quarter turns keep the stepwise boxes tight, so the boxes have to match exactly and not just overlap.
+*/
+int main() {
+    auto sphere = make_shared<Sphere>(point3(0.5, -0.25, 1), 1, make_shared<Lambertian>(color(0.5, 0.5, 0.5)));
+
+    std::vector<Affine> layers = {
+        Affine::translation(vec3(5, 0, 0)),
+        Affine::rotation(vec3(0, 1, 0), 90),
+        Affine::scaling(vec3(2, 0.5, 3)),
+        Affine::translation(vec3(-1, 4, 2)),
+        Affine::rotation(vec3(1, 0, 0), -90),
+        Affine::scaling(vec3(1, 3, 0.25)),
+        Affine::rotation(vec3(0, 0, 1), 180),
+        Affine::translation(vec3(0.5, -2, 7)),
+    };
+
+    shared_ptr<Hittable> folded = sphere, stepwise = sphere;
+    for (const Affine& layer : layers) {
+        folded = make_shared<Transform>(folded, layer);
+        stepwise = make_shared<Transform>(make_shared<Hittable_List>(stepwise), layer);
+    }
+
+    bool ok = true;
+    auto close = [](const vec3& a, const vec3& b) { return (a - b).length() < 1e-9; };
+    AABB a = folded->getBoundingBox(), b = stepwise->getBoundingBox();
+    if (!close(a.m_boxMin, b.m_boxMin) || !close(a.m_boxMax, b.m_boxMax)) {
+        std::clog << "Box " << a.m_boxMin << " .. " << a.m_boxMax << ", stepwise " << b.m_boxMin << " .. "
+                  << b.m_boxMax << '\n';
+        ok = false;
+    }
+
+    // Rays from outside the box towards its centre, from a few directions
+    point3 center = b.centroid();
+    for (const vec3& from : { vec3(50, 3, 1), vec3(-2, 60, -5), vec3(4, -1, -70) }) {
+        Ray r(center + from, -from);
+        Hit_Record ra, rb;
+        bool hitA = folded->hit(r, Interval(0.001, infinity), ra);
+        bool hitB = stepwise->hit(r, Interval(0.001, infinity), rb);
+        if (hitA) ra.object->evaluate(r, ra);
+        if (hitB) rb.object->evaluate(r, rb);
+        if (hitA != hitB || (hitA && (!close(ra.p, rb.p) || !close(ra.normal, rb.normal)))) {
+            std::clog << "Hit from " << from << ": " << ra.p << ", stepwise " << rb.p << '\n';
+            ok = false;
+        }
+    }
+
+    std::clog << "Transform folding " << (ok ? "matches" : "DOES NOT match") << " the stepwise wrappers\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,571 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "utilities.h"
+#include "rtw_stb_image.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const int TEXTURE_TILE_SIZE = 64;
+
+// Linear RGB texels of one tile, row major. Tiles at the right and bottom edges are padded to full size.
+struct Texture_Tile {
+    float texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3];
+};
+
+/*
+    Start of a tile file. The tiles follow at TILE_DATA_OFFSET, level by level, each level row by row, so the
+    layout follows from the size alone. The source file's modification time and size say whether the tiles
+    are still those of the image on disk.
+*/
+struct Tile_File_Header {
+    static constexpr char MAGIC[8] = { 'R', 'T', 'T', 'I', 'L', 'E', 'S', '1' };
+    static constexpr size_t TILE_DATA_OFFSET = 4096;  // Page aligned, so every tile is a whole number of pages
+
+    char magic[8];
+    uint32_t width, height;
+    uint32_t tileSize;
+    uint32_t reserved = 0;
+    int64_t sourceTime;
+    uint64_t sourceSize;
+};
+
+class TextureCache;
+
+/*
+    One image as a mip pyramid cut into 64x64 tiles, kept in a tile file in the cache's directory. The first
+    lookup (or the decode job TextureCache::open() queues) looks for a tile file made from the same version of
+    the image and only decodes the image, builds the pyramid and writes a new file when there is none. Tile
+    files stay behind for the next run.
+
+    Where it can, the file is memory mapped and tiles are read in place, otherwise they are read into copies
+    as lookups need them. Either way they go through the TextureCache, which counts mapped tiles against its
+    budget like copies and hands their pages back to the OS when it evicts them. An image seen from afar only
+    brings in its coarse levels.
+*/
+class Tiled_Image {
+    public:
+        // path is where the image was found, empty when it was not
+        Tiled_Image(TextureCache& cache, std::string path, uint32_t id)
+            : m_cache(cache), m_path(std::move(path)), m_id(id) {}
+
+        Tiled_Image(const Tiled_Image&) = delete;
+        Tiled_Image& operator=(const Tiled_Image&) = delete;
+
+        bool valid() const {
+            convert();
+            return !m_levels.empty();
+        }
+
+        int width() const {
+            return valid() ? m_levels[0].width : 0;
+        }
+
+        int height() const {
+            return valid() ? m_levels[0].height : 0;
+        }
+
+        int levels() const {
+            convert();
+            return int(m_levels.size());
+        }
+
+        uint32_t id() const {
+            return m_id;
+        }
+
+        const std::string& path() const {
+            return m_path;
+        }
+
+        // Makes sure the tiles exist, decoding the image if it has to. Safe to call from any thread.
+        void load() const {
+            convert();
+        }
+
+        /*
+            Trilinear lookup at (s, t), with s running left to right and t top to bottom over [0, 1]. width is
+            the size of the filter footprint in the same units. It picks the pair of levels whose texels are
+            about that wide, 0 gives bilinear filtering on the full resolution image.
+        */
+        color lookup(double s, double t, double width) const {
+            if (!valid())
+                return color(0, 1, 1);
+
+            int res = std::max(m_levels[0].width, m_levels[0].height);
+            double level = std::log2(std::max(width * res, 1.0));
+            int last = int(m_levels.size()) - 1;
+            if (level >= last)
+                return bilinear(last, s, t);
+
+            int l0 = int(level);
+            double f = level - l0;
+            color fine = bilinear(l0, s, t);
+            if (f == 0)
+                return fine;
+            return (1 - f) * fine + f * bilinear(l0 + 1, s, t);
+        }
+
+        color bilinear(int level, double s, double t) const;
+
+        // Clamped to the edges of the level
+        color texel(int level, int x, int y) const;
+
+        // Whether readTile() hands out views into a mapping of the tile file rather than copies
+        bool mapped() const {
+            return m_mapped != nullptr;
+        }
+
+        // One tile for the cache on a miss. A view into the mapping keeps the mapping alive.
+        shared_ptr<const Texture_Tile> readTile(int level, int tileX, int tileY) const {
+            if (m_mapped)
+                return shared_ptr<const Texture_Tile>(m_mapping, &m_mapped[tileIndex(level, tileX, tileY)]);
+
+            auto tile = make_shared<Texture_Tile>();
+            std::lock_guard<std::mutex> lock(m_fileMutex);
+            m_file.seekg(std::streamoff(tileOffset(level, tileX, tileY)));
+            m_file.read(reinterpret_cast<char*>(tile->texels), sizeof(Texture_Tile));
+            return tile;
+        }
+
+    private:
+        struct Level {
+            int width, height;
+            int tilesX, tilesY;
+            uint64_t firstTile;  // Index of its first tile in the tile file
+        };
+
+        void convert() const {
+            std::call_once(m_converted, [this]() { loadTiles(); });
+        }
+
+        uint64_t tileIndex(int level, int tileX, int tileY) const {
+            const Level& l = m_levels[level];
+            return l.firstTile + uint64_t(tileY) * l.tilesX + tileX;
+        }
+
+        uint64_t tileOffset(int level, int tileX, int tileY) const {
+            return Tile_File_Header::TILE_DATA_OFFSET + tileIndex(level, tileX, tileY) * sizeof(Texture_Tile);
+        }
+
+        const Texture_Tile& tileAt(int level, int tileX, int tileY) const;
+
+        // Levels of a w x h pyramid down to 1 x 1, and how many tiles they take
+        static std::vector<Level> pyramid(int w, int h, uint64_t& tileCount) {
+            std::vector<Level> levels;
+            tileCount = 0;
+            while (true) {
+                Level l{ w, h, (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE, (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE, tileCount };
+                tileCount += uint64_t(l.tilesX) * l.tilesY;
+                levels.push_back(l);
+                if (w == 1 && h == 1)
+                    return levels;
+                w = std::max(1, w / 2);
+                h = std::max(1, h / 2);
+            }
+        }
+
+        void loadTiles() const;
+        bool openTiles(const std::filesystem::path& tilePath, int64_t sourceTime, uint64_t sourceSize) const;
+        bool writeTiles(const std::filesystem::path& tilePath, int64_t sourceTime, uint64_t sourceSize) const;
+
+        TextureCache& m_cache;
+        std::string m_path;
+        uint32_t m_id;
+
+        mutable std::once_flag m_converted;
+        mutable std::vector<Level> m_levels;
+        mutable const Texture_Tile* m_mapped = nullptr;  // First tile, when the file is mapped
+        mutable shared_ptr<void> m_mapping;              // Unmaps the file once no image or cached tile uses it
+        mutable std::ifstream m_file;
+        mutable std::mutex m_fileMutex;
+};
+
+/*
+    Registry of every Tiled_Image, and the resident tiles of all of them under one memory budget.
+
+    Images are registered by the path they resolve to, so every texture naming the same file shares one
+    handle. Tiles are spread over shards by key, each with its own lock, LRU list and share of the budget, and
+    evicted least recently used first. Copies are freed on eviction, and the pages of mapped tiles are dropped
+    with madvise(MADV_DONTNEED), to be faulted back in from the file if the tile is needed again. Each thread
+    also remembers the last few tiles it used, so lookups that stay inside a tile never take a lock, and
+    a tile evicted while a thread still holds it stays readable.
+*/
+class TextureCache {
+    public:
+        static const size_t DEFAULT_BUDGET = size_t(256) << 20;
+
+        explicit TextureCache(size_t memoryBudget = DEFAULT_BUDGET, std::filesystem::path directory = defaultDirectory())
+            : m_directory(std::move(directory)) {
+            setMemoryBudget(memoryBudget);
+        }
+
+        // RT_TEXTURE_CACHE when set, so tile files can live somewhere that outlasts the temp directory
+        static std::filesystem::path defaultDirectory() {
+            if (const char* dir = getenv("RT_TEXTURE_CACHE"))
+                return dir;
+            return std::filesystem::temp_directory_path() / "rt_texture_tiles";
+        }
+
+        /*
+            Shared handle to the image filename resolves to. A file seen for the first time is decoded by a job
+            on the global thread pool right away, so loading overlaps building the rest of the scene and its
+            BVH. A lookup that gets there first waits for that job, or does the work itself if it has not
+            started.
+        */
+        shared_ptr<Tiled_Image> open(const std::string& filename) {
+            std::string path = rtw_image::resolve(filename);
+            if (path.empty()) {
+                std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+                return make_shared<Tiled_Image>(*this, path, m_nextId++);
+            }
+
+            std::error_code error;
+            std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+            std::string key = error ? path : canonical.string();
+
+            shared_ptr<Tiled_Image> image;
+            {
+                std::lock_guard<std::mutex> lock(m_registryMutex);
+                std::weak_ptr<Tiled_Image>& entry = m_images[key];
+                image = entry.lock();
+                if (image)
+                    return image;
+                image = make_shared<Tiled_Image>(*this, key, m_nextId++);
+                entry = image;
+            }
+
+            globalThreadPool().queueJob([image](int) { image->load(); }, 0);
+            return image;
+        }
+
+        // Takes effect as tiles come in, anything over the new budget is evicted on the next misses
+        void setMemoryBudget(size_t bytes) {
+            m_shardBudget = std::max(bytes / SHARDS, sizeof(Texture_Tile));
+        }
+
+        size_t memoryBudget() const {
+            return m_shardBudget * SHARDS;
+        }
+
+        // Tiles held against the budget, read copies and touched tiles of mapped files alike
+        size_t residentBytes() {
+            size_t total = 0;
+            for (Shard& shard : m_shards) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                total += shard.bytes;
+            }
+            return total;
+        }
+
+        const std::filesystem::path& directory() const {
+            return m_directory;
+        }
+
+        // Tile (tileX, tileY) of level. The reference stays valid until this thread's next call.
+        const Texture_Tile& tile(const Tiled_Image& image, int level, int tileX, int tileY) {
+            uint64_t key = (uint64_t(image.id()) << 40) | (uint64_t(level) << 32) | (uint64_t(tileY) << 16) | uint64_t(tileX);
+
+            struct Recent {
+                uint64_t key = ~uint64_t(0);
+                shared_ptr<const Texture_Tile> tile;
+            };
+            thread_local Recent recent[RECENT];
+            Recent& slot = recent[mixBits(key) % RECENT];
+            if (slot.key == key)
+                return *slot.tile;
+
+            slot.tile = fetch(image, level, tileX, tileY, key);
+            slot.key = key;
+            return *slot.tile;
+        }
+
+    private:
+        static const int SHARDS = 16;
+        static const int RECENT = 8;
+
+        struct Entry {
+            shared_ptr<const Texture_Tile> tile;
+            std::list<uint64_t>::iterator lruPosition;
+            bool mapped;  // A view into a tile file mapping rather than a copy
+        };
+
+        // Gives the pages of an evicted mapped tile back. Tiles are whole pages when pages are 4 KiB, with
+        // larger pages madvise() refuses and the pages stay until the OS reclaims them.
+        static void release(const Entry& entry) {
+#ifdef __linux__
+            if (entry.mapped)
+                madvise(const_cast<Texture_Tile*>(entry.tile.get()), sizeof(Texture_Tile), MADV_DONTNEED);
+#endif
+        }
+
+        struct Shard {
+            std::mutex mutex;
+            std::unordered_map<uint64_t, Entry> tiles;
+            std::list<uint64_t> lru;  // Most recently used first
+            size_t bytes = 0;
+        };
+
+        shared_ptr<const Texture_Tile> fetch(const Tiled_Image& image, int level, int tileX, int tileY, uint64_t key) {
+            Shard& shard = m_shards[mixBits(key) % SHARDS];
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.tiles.find(key);
+                if (it != shard.tiles.end()) {
+                    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lruPosition);
+                    return it->second.tile;
+                }
+            }
+
+            // Read outside the lock. Two threads missing on the same tile both read it, the second insert
+            // finds the first one's copy and uses that.
+            shared_ptr<const Texture_Tile> loaded = image.readTile(level, tileX, tileY);
+
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.tiles.find(key);
+            if (it != shard.tiles.end())
+                return it->second.tile;
+
+            shard.lru.push_front(key);
+            shard.tiles.emplace(key, Entry{ loaded, shard.lru.begin(), image.mapped() });
+            shard.bytes += sizeof(Texture_Tile);
+            while (shard.bytes > m_shardBudget && shard.lru.size() > 1) {
+                auto victim = shard.tiles.find(shard.lru.back());
+                release(victim->second);
+                shard.tiles.erase(victim);
+                shard.lru.pop_back();
+                shard.bytes -= sizeof(Texture_Tile);
+            }
+            return loaded;
+        }
+
+        std::filesystem::path m_directory;
+        std::atomic<size_t> m_shardBudget{ 0 };
+        Shard m_shards[SHARDS];
+
+        // Handles only, an image no texture uses any more is freed
+        std::mutex m_registryMutex;
+        std::unordered_map<std::string, std::weak_ptr<Tiled_Image>> m_images;
+
+        // Ids are never reused, so the per thread tile memory can not mistake a new image for an old one
+        static inline std::atomic<uint32_t> m_nextId{ 0 };
+};
+
+inline TextureCache& globalTextureCache() {
+    static TextureCache cache;
+    return cache;
+}
+
+inline color Tiled_Image::bilinear(int level, double s, double t) const {
+    const Level& l = m_levels[level];
+    double x = s * l.width - 0.5, y = t * l.height - 0.5;
+    int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+    double dx = x - x0, dy = y - y0;
+
+    // Usually all four texels are in one tile, which is then only asked for once
+    const Texture_Tile* tile = nullptr;
+    int tileX = -1, tileY = -1;
+    auto at = [&](int tx, int ty) {
+        tx = std::clamp(tx, 0, l.width - 1);
+        ty = std::clamp(ty, 0, l.height - 1);
+        if (tx / TEXTURE_TILE_SIZE != tileX || ty / TEXTURE_TILE_SIZE != tileY) {
+            tileX = tx / TEXTURE_TILE_SIZE;
+            tileY = ty / TEXTURE_TILE_SIZE;
+            tile = &tileAt(level, tileX, tileY);
+        }
+        const float* texel = tile->texels + ((ty % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + tx % TEXTURE_TILE_SIZE) * 3;
+        return color(texel[0], texel[1], texel[2]);
+    };
+    return (1 - dx) * (1 - dy) * at(x0, y0) + dx * (1 - dy) * at(x0 + 1, y0) +
+           (1 - dx) * dy * at(x0, y0 + 1) + dx * dy * at(x0 + 1, y0 + 1);
+}
+
+inline color Tiled_Image::texel(int level, int x, int y) const {
+    const Level& l = m_levels[level];
+    x = std::clamp(x, 0, l.width - 1);
+    y = std::clamp(y, 0, l.height - 1);
+
+    const Texture_Tile& tile = tileAt(level, x / TEXTURE_TILE_SIZE, y / TEXTURE_TILE_SIZE);
+    const float* t = tile.texels + ((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE) * 3;
+    return color(t[0], t[1], t[2]);
+}
+
+inline const Texture_Tile& Tiled_Image::tileAt(int level, int tileX, int tileY) const {
+    return m_cache.tile(*this, level, tileX, tileY);
+}
+
+inline void Tiled_Image::loadTiles() const {
+    if (m_path.empty())
+        return;
+
+    std::error_code error;
+    int64_t sourceTime = int64_t(std::filesystem::last_write_time(m_path, error).time_since_epoch().count());
+    uint64_t sourceSize = std::filesystem::file_size(m_path, error);
+    if (error) {
+        std::cerr << "ERROR: Could not read image file '" << m_path << "'.\n";
+        return;
+    }
+
+    // Named after the path (FNV-1a, stable from run to run), the header tells which version it holds
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : m_path)
+        hash = (hash ^ uint8_t(c)) * 0x100000001b3ull;
+    char name[24];
+    snprintf(name, sizeof(name), "%016llx.tiles", (unsigned long long)hash);
+    std::filesystem::path tilePath = m_cache.directory() / name;
+
+    if (openTiles(tilePath, sourceTime, sourceSize))
+        return;
+
+    // Written under a name of its own and renamed into place, so other threads or renders opening the same
+    // file never see half of it
+    std::filesystem::create_directories(m_cache.directory(), error);
+    std::filesystem::path partial = tilePath;
+    partial += "." + std::to_string(mixBits(reinterpret_cast<uintptr_t>(this) ^ uint64_t(m_id))) + ".partial";
+    if (!writeTiles(partial, sourceTime, sourceSize)) {
+        std::filesystem::remove(partial, error);
+        return;
+    }
+    std::filesystem::rename(partial, tilePath, error);
+    if (error) {
+        std::cerr << "ERROR: Could not write texture tiles to '" << tilePath.string() << "'.\n";
+        std::filesystem::remove(partial, error);
+        return;
+    }
+    openTiles(tilePath, sourceTime, sourceSize);
+}
+
+inline bool Tiled_Image::openTiles(const std::filesystem::path& tilePath, int64_t sourceTime, uint64_t sourceSize) const {
+    std::ifstream file(tilePath, std::ios::binary);
+    Tile_File_Header header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+    if (std::memcmp(header.magic, Tile_File_Header::MAGIC, sizeof(header.magic)) != 0 ||
+        header.tileSize != TEXTURE_TILE_SIZE || header.sourceTime != sourceTime || header.sourceSize != sourceSize ||
+        header.width == 0 || header.height == 0)
+        return false;
+
+    uint64_t tileCount;
+    std::vector<Level> levels = pyramid(int(header.width), int(header.height), tileCount);
+    uint64_t fileSize = Tile_File_Header::TILE_DATA_OFFSET + tileCount * sizeof(Texture_Tile);
+    std::error_code error;
+    if (std::filesystem::file_size(tilePath, error) != fileSize || error)
+        return false;
+
+#ifdef __linux__
+    int fd = ::open(tilePath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping != MAP_FAILED) {
+            m_mapping = shared_ptr<void>(mapping, [fileSize](void* address) { munmap(address, fileSize); });
+            m_mapped = reinterpret_cast<const Texture_Tile*>(static_cast<const char*>(mapping) + Tile_File_Header::TILE_DATA_OFFSET);
+            m_levels = std::move(levels);
+            return true;
+        }
+    }
+#endif
+
+    m_file = std::move(file);
+    m_levels = std::move(levels);
+    return true;
+}
+
+inline bool Tiled_Image::writeTiles(const std::filesystem::path& tilePath, int64_t sourceTime, uint64_t sourceSize) const {
+    std::vector<float> pixels;
+    int w, h;
+    {
+        rtw_image image;
+        if (!image.load(m_path)) {
+            std::cerr << "ERROR: Could not decode image file '" << m_path << "'.\n";
+            return false;
+        }
+        w = image.width();
+        h = image.height();
+        const float* data = image.pixel_data(0, 0);
+        pixels.assign(data, data + size_t(w) * h * 3);
+    }
+
+    std::ofstream out(tilePath, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "ERROR: Could not write texture tiles to '" << tilePath.string() << "'.\n";
+        return false;
+    }
+
+    Tile_File_Header header;
+    std::memcpy(header.magic, Tile_File_Header::MAGIC, sizeof(header.magic));
+    header.width = uint32_t(w);
+    header.height = uint32_t(h);
+    header.tileSize = TEXTURE_TILE_SIZE;
+    header.sourceTime = sourceTime;
+    header.sourceSize = sourceSize;
+    std::vector<char> page(Tile_File_Header::TILE_DATA_OFFSET, 0);
+    std::memcpy(page.data(), &header, sizeof(header));
+    out.write(page.data(), std::streamsize(page.size()));
+
+    // Each level is written as tiles, then box filtered down to the next until one texel is left
+    uint64_t tileCount;
+    std::vector<Level> levels = pyramid(w, h, tileCount);
+    auto tile = std::make_unique<Texture_Tile>();
+    for (const Level& l : levels) {
+        for (int ty = 0; ty < l.tilesY; ++ty) {
+            for (int tx = 0; tx < l.tilesX; ++tx) {
+                for (int y = 0; y < TEXTURE_TILE_SIZE; ++y) {
+                    for (int x = 0; x < TEXTURE_TILE_SIZE; ++x) {
+                        int sx = std::min(tx * TEXTURE_TILE_SIZE + x, w - 1);
+                        int sy = std::min(ty * TEXTURE_TILE_SIZE + y, h - 1);
+                        for (int c = 0; c < 3; ++c)
+                            tile->texels[(y * TEXTURE_TILE_SIZE + x) * 3 + c] = pixels[(size_t(sy) * w + sx) * 3 + c];
+                    }
+                }
+                out.write(reinterpret_cast<const char*>(tile->texels), sizeof(Texture_Tile));
+            }
+        }
+        if (w == 1 && h == 1)
+            break;
+
+        int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+        std::vector<float> next(size_t(nw) * nh * 3);
+        for (int y = 0; y < nh; ++y) {
+            for (int x = 0; x < nw; ++x) {
+                int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                for (int c = 0; c < 3; ++c) {
+                    next[(size_t(y) * nw + x) * 3 + c] = 0.25f * (pixels[(size_t(y0) * w + x0) * 3 + c] +
+                                                                  pixels[(size_t(y0) * w + x1) * 3 + c] +
+                                                                  pixels[(size_t(y1) * w + x0) * 3 + c] +
+                                                                  pixels[(size_t(y1) * w + x1) * 3 + c]);
+                }
+            }
+        }
+        pixels.swap(next);
+        w = nw;
+        h = nh;
+    }
+
+    out.close();
+    if (!out) {
+        std::cerr << "ERROR: Could not write texture tiles to '" << tilePath.string() << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -1,94 +1,373 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
 #include <thread>
 #include <mutex>
-#include <queue>
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 /*
     mutex - When locked, threads block until they can acquire it, allowing for synch
     unique_lock - Locks the mutex for the scope
-    condition_variable - 
-        .notify_one() - notifies a single thread 
+    condition_variable -
+        .notify_one() - notifies a single thread
         .notify_all() - notifies all waiting threads
-        .wait() - waits on a condition before proceeding. When a notify_one is used, a random thread checks its wait(), 
+        .wait() - waits on a condition before proceeding. When a notify_one is used, a random thread checks its wait(),
                   when notify all is used all of them do
-    atomic - a variable that is free from data races. Basically, guarantees CORRECT informaiton. Slow 
+    atomic - a variable that is free from data races. Basically, guarantees CORRECT informaiton. Slow
+*/
+
+/*
+    Bounded multi producer/multi consumer queue (Dmitry Vyukov's design).
+    Every cell carries a sequence number that tells producers and consumers whose turn it is, so a push or
+    pop is one CAS on the shared position plus a store to the cell. Nothing ever takes a lock.
+*/
+template<typename T>
+class JobQueue {
+    public:
+        explicit JobQueue(size_t capacity) : m_cells(new Cell[capacity]), m_mask(capacity - 1) {
+            // Capacity has to be a power of two so positions can wrap with a mask
+            for (size_t i = 0; i < capacity; ++i)
+                m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        bool push(const T& data) {
+            Cell* cell;
+            size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &m_cells[pos & m_mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(seq) - intptr_t(pos);
+                if (diff == 0) {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false; // Full
+                } else {
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = data;
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& data) {
+            Cell* cell;
+            size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &m_cells[pos & m_mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+                if (diff == 0) {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false; // Empty
+                } else {
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            data = cell->data;
+            cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+        std::unique_ptr<Cell[]> m_cells;
+        size_t m_mask;
+        alignas(64) std::atomic<size_t> m_enqueuePos{0};
+        alignas(64) std::atomic<size_t> m_dequeuePos{0};
+};
+
+/*
+    Persistent worker pool. Start it once and keep queueing work into it; render after render reuses the same
+    threads.
+
+    Jobs are a plain function pointer + context + argument, so the queue never boxes them. queueJobs() submits
+    a whole batch as one shared context whose indices are claimed with an atomic counter, which keeps the
+    queue traffic independent of how finely the work is split.
+
+    waitForCompletion() waits on a pending count with a predicate, so it cannot miss a completion that
+    happened before it was called, and the waiting thread runs queued jobs itself while it waits.
 */
 class ThreadPool {
     public:
-        void start() {
-            njobs_pending = 0;
-            uint32_t num_threads = std::thread::hardware_concurrency();
-            for(uint32_t i = 0; i < num_threads; ++i)
-                threads.push_back(std::thread(&ThreadPool::threadLoop, this));
+        ThreadPool() : m_jobs(QUEUE_CAPACITY) {}
 
+        ~ThreadPool() {
+            stop();
         }
-        void queueJob(std::function<void(int)> job, int i) {
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                jobs.push( [job, i] () {job(i);} );
-                ++njobs_pending;
+
+        // num_threads = 0 uses every hardware thread. Calling start() on a running pool does nothing.
+        void start(uint32_t num_threads = 0, bool pin_threads = false) {
+            if (!threads.empty())
+                return;
+
+            uint32_t hw_threads = std::max(1u, std::thread::hardware_concurrency());
+            if (num_threads == 0)
+                num_threads = hw_threads;
+
+            should_terminate = false;
+            for (uint32_t i = 0; i < num_threads; ++i) {
+                threads.push_back(std::thread(&ThreadPool::threadLoop, this));
+                if (pin_threads)
+                    pinThread(threads.back(), i % hw_threads);
             }
-            mutex_condition.notify_one();
+        }
+
+        void queueJob(std::function<void(int)> job, int i) {
+            auto* boxed = new std::function<void(int)>(std::move(job));
+            push(Job{ &runSingle, boxed, i });
+            wake(1);
         };
+
+        // Runs job(0) ... job(count - 1) across the pool
+        void queueJobs(int count, std::function<void(int)> job) {
+            if (count <= 0)
+                return;
+
+            int runners = std::min(count, threadCount() + 1);
+            auto* batch = new Batch{ std::move(job), count, {0}, {runners} };
+            for (int r = 0; r < runners; ++r)
+                push(Job{ &runBatch, batch, 0 });
+            wake(runners);
+        }
+
+        // Runs job(0) ... job(count - 1) and returns once all of them are done. The caller claims indices
+        // alongside the workers, so this is safe to call from inside a job as well.
+        void parallelFor(int count, std::function<void(int)> job) {
+            if (count <= 0)
+                return;
+            if (count == 1 || threads.empty()) {
+                for (int i = 0; i < count; ++i)
+                    job(i);
+                return;
+            }
+
+            int helpers = std::min(count - 1, threadCount());
+            // The caller holds one reference so the batch outlives the helpers
+            auto* batch = new Batch{ std::move(job), count, {0}, {helpers + 1} };
+            for (int r = 0; r < helpers; ++r)
+                push(Job{ &runBatch, batch, 0 });
+            wake(helpers);
+
+            for (int i = batch->next++; i < count; i = batch->next++) {
+                batch->job(i);
+                ++batch->completed;
+            }
+
+            Job other;
+            while (batch->completed.load() < count) {
+                if (m_jobs.pop(other)) {
+                    --njobs_queued;
+                    run(other);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+
+            if (--batch->runners == 0)
+                delete batch;
+        }
+
         void stop() {
             {
-                std::unique_lock<std::mutex> lock(queue_mutex);
+                std::unique_lock<std::mutex> lock(wake_mutex);
                 should_terminate = true;
             }
-            mutex_condition.notify_all();
+            wake_condition.notify_all();
             for (std::thread& active_thread : threads) {
                 active_thread.join();
             }
             threads.clear();
         }
+
         void waitForCompletion() {
-            std::unique_lock<std::mutex> lock(main_mutex);
-            main_condition.wait(lock);
+            Job job;
+            while (njobs_pending.load() > 0) {
+                if (m_jobs.pop(job)) {
+                    --njobs_queued;
+                    run(job);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(main_mutex);
+                main_condition.wait(lock, [this] {
+                    return njobs_pending.load() == 0;
+                });
+            }
+        }
+
+        int threadCount() const {
+            return int(threads.size());
         }
 
         int jobCount() const {
-            return jobs.size();
+            return njobs_queued.load();
         }
 
     private:
+        struct Job {
+            void (*fn)(void* ctx, int arg) = nullptr;
+            void* ctx = nullptr;
+            int arg = 0;
+        };
+
+        struct Batch {
+            std::function<void(int)> job;
+            int count;
+            std::atomic<int> next;
+            std::atomic<int> runners;
+            std::atomic<int> completed{0};
+        };
+
+        static void runSingle(void* ctx, int arg) {
+            auto* job = static_cast<std::function<void(int)>*>(ctx);
+            (*job)(arg);
+            delete job;
+        }
+
+        static void runBatch(void* ctx, int) {
+            auto* batch = static_cast<Batch*>(ctx);
+            for (int i = batch->next++; i < batch->count; i = batch->next++) {
+                batch->job(i);
+                ++batch->completed;
+            }
+            if (--batch->runners == 0)
+                delete batch;
+        }
+
+        static void pinThread(std::thread& thread, uint32_t cpu) {
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &set);
+#endif
+        }
+
+        void push(const Job& job) {
+            ++njobs_pending;
+            // A full queue means the workers are far behind, so the producer lends a hand
+            Job other;
+            while (!m_jobs.push(job)) {
+                if (m_jobs.pop(other)) {
+                    --njobs_queued;
+                    run(other);
+                }
+            }
+            ++njobs_queued;
+        }
+
+        void wake(int count) {
+            // Pairs with the sleeper count in threadLoop(), see the comment there
+            if (nsleeping.load() == 0)
+                return;
+
+            { std::unique_lock<std::mutex> lock(wake_mutex); }
+            if (count == 1)
+                wake_condition.notify_one();
+            else
+                wake_condition.notify_all();
+        }
+
+        void run(const Job& job) {
+            job.fn(job.ctx, job.arg);
+            if (--njobs_pending == 0) {
+                { std::unique_lock<std::mutex> lock(main_mutex); }
+                main_condition.notify_all();
+            }
+        }
+
         void threadLoop() {
+            Job job;
             while (true) {
-                std::function<void()>  job;
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    mutex_condition.wait(lock, [this] {
-                        return !jobs.empty() || should_terminate;
-                    });
-                    if (should_terminate) {
-                        return;
-                    }
-                    job = jobs.front();
-                    jobs.pop();
+                if (m_jobs.pop(job)) {
+                    --njobs_queued;
+                    run(job);
+                    continue;
                 }
-                job();
-                if ( --njobs_pending == 0 ) {
-                    main_condition.notify_one();
-                } else {
-                    clog << njobs_pending << " jobs left\n";
+
+                // Sleepers register before checking the queued count and producers bump the queued count
+                // before checking for sleepers, so one of the two always sees the other.
+                std::unique_lock<std::mutex> lock(wake_mutex);
+                ++nsleeping;
+                wake_condition.wait(lock, [this] {
+                    return njobs_queued.load() > 0 || should_terminate;
+                });
+                --nsleeping;
+                if (should_terminate && njobs_queued.load() == 0) {
+                    return;
                 }
             }
         }
 
+        static const size_t QUEUE_CAPACITY = 1 << 16;
+
         bool should_terminate = false;
-        std::mutex queue_mutex;
-        std::condition_variable mutex_condition;
         std::vector<std::thread> threads;
-        std::queue<std::function<void()>> jobs;
+        JobQueue<Job> m_jobs;
+
+        std::atomic<int> njobs_pending{0};  // Queued or running
+        std::atomic<int> njobs_queued{0};   // Sitting in the queue
+        std::atomic<int> nsleeping{0};
 
-        std::atomic<int> njobs_pending;
+        std::mutex wake_mutex;
+        std::condition_variable wake_condition;
         std::mutex main_mutex;
         std::condition_variable main_condition;
+};
 
+// The shared pool and the settings it starts with, see configureGlobalThreadPool()
+struct Global_Thread_Pool {
+    ThreadPool pool;
+    uint32_t num_threads = 0;
+    bool pin_threads = false;
 };
 
-#endif
\ No newline at end of file
+inline Global_Thread_Pool& globalThreadPoolState() {
+    static Global_Thread_Pool state;
+    return state;
+}
+
+// The pool every part of the renderer shares, started on first use. Unless configureGlobalThreadPool() said
+// otherwise, that is one unpinned worker per hardware thread.
+inline ThreadPool& globalThreadPool() {
+    Global_Thread_Pool& state = globalThreadPoolState();
+    state.pool.start(state.num_threads, state.pin_threads);
+    return state.pool;
+}
+
+/*
+    Worker count (0 for every hardware thread) and CPU pinning of globalThreadPool(). Best called before
+    anything uses the pool. If it is already running with other settings, it finishes the jobs it has and
+    restarts with the new ones, so nothing may queue jobs from other threads while this runs.
+*/
+inline void configureGlobalThreadPool(uint32_t num_threads, bool pin_threads) {
+    Global_Thread_Pool& state = globalThreadPoolState();
+    if (state.pool.threadCount() > 0 && (state.num_threads != num_threads || state.pin_threads != pin_threads)) {
+        state.pool.waitForCompletion();
+        state.pool.stop();
+    }
+    state.num_threads = num_threads;
+    state.pin_threads = pin_threads;
+    state.pool.start(num_threads, pin_threads);
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/*
+    Splits the image into square tiles and hands them out to render workers.
+
+    Tiles are laid out along a space filling curve so neighbouring tiles (and the BVH nodes/textures they touch)
+    are rendered close together in time. The curve is cut into one contiguous run per worker. A worker pops
+    tiles from the front of its own run, and once that is empty it steals from the back of someone else's.
+
+    Each run is a packed [begin, end) pair in a single atomic, so popping and stealing are one CAS each and
+    nobody ever blocks on a lock.
+*/
+enum class TileOrder { Scanline, Morton, Hilbert };
+
+struct Tile {
+    int x0, y0;  // Inclusive top left pixel
+    int x1, y1;  // Exclusive bottom right pixel
+};
+
+class TileScheduler {
+    public:
+        void reset(int image_width, int image_height, int tile_size, TileOrder order, int worker_count) {
+            m_imageWidth = image_width;
+            m_imageHeight = image_height;
+            m_tileSize = std::max(1, tile_size);
+            m_tilesX = (image_width + m_tileSize - 1) / m_tileSize;
+            m_tilesY = (image_height + m_tileSize - 1) / m_tileSize;
+
+            buildTileOrder(order);
+
+            worker_count = std::max(1, worker_count);
+            m_queues = std::vector<WorkerQueue>(worker_count);
+            uint32_t tileCount = uint32_t(m_tiles.size());
+            for (int w = 0; w < worker_count; ++w) {
+                uint32_t begin = uint32_t(uint64_t(tileCount) * w / worker_count);
+                uint32_t end   = uint32_t(uint64_t(tileCount) * (w + 1) / worker_count);
+                m_queues[w].range.store(pack(begin, end), std::memory_order_relaxed);
+            }
+        }
+
+        // Fetches the next tile for the given worker. Returns false once every tile has been handed out.
+        bool next(int worker, Tile& tile) {
+            uint32_t idx;
+            if (!popFront(m_queues[worker], idx)) {
+                bool stolen = false;
+                int count = int(m_queues.size());
+                for (int i = 1; i < count && !stolen; ++i)
+                    stolen = popBack(m_queues[(worker + i) % count], idx);
+                if (!stolen)
+                    return false;
+            }
+
+            uint32_t code = m_tiles[idx];
+            int tx = int(code & 0xFFFF), ty = int(code >> 16);
+            tile.x0 = tx * m_tileSize;
+            tile.y0 = ty * m_tileSize;
+            tile.x1 = std::min(tile.x0 + m_tileSize, m_imageWidth);
+            tile.y1 = std::min(tile.y0 + m_tileSize, m_imageHeight);
+            return true;
+        }
+
+        int tileCount() const {
+            return int(m_tiles.size());
+        }
+
+    private:
+        struct alignas(64) WorkerQueue {
+            std::atomic<uint64_t> range{0};
+
+            WorkerQueue() = default;
+            WorkerQueue(const WorkerQueue&) {}
+        };
+
+        static uint64_t pack(uint32_t begin, uint32_t end) {
+            return (uint64_t(begin) << 32) | end;
+        }
+
+        static bool popFront(WorkerQueue& q, uint32_t& idx) {
+            uint64_t cur = q.range.load(std::memory_order_relaxed);
+            while (true) {
+                uint32_t begin = uint32_t(cur >> 32), end = uint32_t(cur);
+                if (begin >= end)
+                    return false;
+                if (q.range.compare_exchange_weak(cur, pack(begin + 1, end), std::memory_order_acq_rel)) {
+                    idx = begin;
+                    return true;
+                }
+            }
+        }
+
+        static bool popBack(WorkerQueue& q, uint32_t& idx) {
+            uint64_t cur = q.range.load(std::memory_order_relaxed);
+            while (true) {
+                uint32_t begin = uint32_t(cur >> 32), end = uint32_t(cur);
+                if (begin >= end)
+                    return false;
+                if (q.range.compare_exchange_weak(cur, pack(begin, end - 1), std::memory_order_acq_rel)) {
+                    idx = end - 1;
+                    return true;
+                }
+            }
+        }
+
+        void buildTileOrder(TileOrder order) {
+            // Tiles are stored as (ty << 16 | tx), sorted by their position along the chosen curve
+            std::vector<std::pair<uint64_t, uint32_t>> keyed;
+            keyed.reserve(size_t(m_tilesX) * m_tilesY);
+
+            uint32_t side = 1;
+            while (side < uint32_t(std::max(m_tilesX, m_tilesY)))
+                side <<= 1;
+
+            for (int ty = 0; ty < m_tilesY; ++ty) {
+                for (int tx = 0; tx < m_tilesX; ++tx) {
+                    uint64_t key;
+                    if (order == TileOrder::Morton)
+                        key = mortonEncode2D(tx, ty);
+                    else if (order == TileOrder::Hilbert)
+                        key = hilbertIndex(side, tx, ty);
+                    else
+                        key = uint64_t(ty) * m_tilesX + tx;
+                    keyed.push_back({key, (uint32_t(ty) << 16) | uint32_t(tx)});
+                }
+            }
+
+            std::sort(keyed.begin(), keyed.end());
+            m_tiles.clear();
+            for (auto& k : keyed)
+                m_tiles.push_back(k.second);
+        }
+
+        static uint64_t spreadBits(uint32_t x) {
+            uint64_t v = x & 0xFFFF;
+            v = (v | (v << 8)) & 0x00FF00FF;
+            v = (v | (v << 4)) & 0x0F0F0F0F;
+            v = (v | (v << 2)) & 0x33333333;
+            v = (v | (v << 1)) & 0x55555555;
+            return v;
+        }
+
+        static uint64_t mortonEncode2D(uint32_t x, uint32_t y) {
+            return spreadBits(x) | (spreadBits(y) << 1);
+        }
+
+        //https://en.wikipedia.org/wiki/Hilbert_curve
+        static uint64_t hilbertIndex(uint32_t side, uint32_t x, uint32_t y) {
+            uint64_t d = 0;
+            for (uint32_t s = side / 2; s > 0; s /= 2) {
+                uint32_t rx = (x & s) > 0;
+                uint32_t ry = (y & s) > 0;
+                d += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+                // Rotate the quadrant so the curve stays continuous
+                if (ry == 0) {
+                    if (rx == 1) {
+                        x = side - 1 - x;
+                        y = side - 1 - y;
+                    }
+                    std::swap(x, y);
+                }
+            }
+            return d;
+        }
+
+        int m_imageWidth = 0;
+        int m_imageHeight = 0;
+        int m_tileSize = 16;
+        int m_tilesX = 0;
+        int m_tilesY = 0;
+        std::vector<uint32_t> m_tiles;
+        std::vector<WorkerQueue> m_queues;
+};
+
+#endif
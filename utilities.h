@@ -7,6 +7,8 @@
 #include <memory>
 #include <random>
 
+#include "rng.h"
+
 #define MT_RENDER 1
 
 using std::make_shared;
@@ -14,22 +16,16 @@ using std::shared_ptr;
 using std::sqrt;
 using std::fabs;
 
-thread_local unsigned int seed;
-
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
-#if MT_RENDER
-    inline double random_double() {
-        // Returns a random real in [0,1).
-        return rand_r(&seed) / (RAND_MAX + 1.0);
-    }
-#else
+// For building scenes only. Everything that runs during a render takes its random numbers from the
+// Sampler or a PCG32 keyed by what it is used for, so results never depend on which thread ran them.
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    thread_local PCG32 rng;
+    return rng.uniform();
 }
-#endif
 
 inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
@@ -149,6 +149,31 @@ inline vec3 random_unit_vector() {
     return unit_vector(random_in_unit_sphere());
 }
 
+// Maps two uniform numbers in [0,1) to a uniform direction on the unit sphere
+inline vec3 sample_unit_sphere(double u1, double u2) {
+    double z = 1 - 2 * u1;
+    double r = sqrt(fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * u2;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// Shirley and Chiu's concentric map from the unit square to the unit disk, keeps strata compact
+inline vec3 sample_unit_disk(double u1, double u2) {
+    double a = 2 * u1 - 1, b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    const double quarter_pi = pi / 4;
+    double r, theta;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        theta = quarter_pi * (b / a);
+    } else {
+        r = b;
+        theta = 2 * quarter_pi - quarter_pi * (a / b);
+    }
+    return vec3(r * cos(theta), r * sin(theta), 0);
+}
+
 inline vec3 random_on_hemisphere(const vec3& normal) {
     vec3 ruv = random_unit_vector();
 
@@ -0,0 +1,275 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "utilities.h"
+#include "perlin.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <vector>
+
+// Media sample their free flight distance during traversal, where no sampler is at hand. The stream is keyed
+// by the ray and the distance it enters the medium at instead. Rays come from the sampler, so this is as
+// reproducible as the rest of the path, and does not depend on the order nodes are visited. Media that can be
+// entered at the same distance pass their own id as well, so that they do not draw the same numbers.
+inline PCG32 mediumRng(const Ray& r, double tEnter, uint64_t mediumId = 0) {
+    uint64_t key = hashCombine(hashDouble(tEnter) ^ hashDouble(r.time()), mediumId);
+    for (int a = 0; a < 3; ++a) {
+        key = hashCombine(key, hashDouble(r.origin()[a]));
+        key = hashCombine(key, hashDouble(r.direction()[a]));
+    }
+    return PCG32(key);
+}
+
+/*
+    Calls inside(t0, t1) for each stretch of r within ray_t that lies inside the closed surface boundary,
+    nearest first, until it returns true. Each boundary crossing costs one hit() query, and whether the walk
+    starts inside comes from the facing of the first crossing, so non-convex boundaries (and rays that enter
+    and leave several times) work.
+*/
+template<typename F>
+bool forEachInside(const Hittable& boundary, const Ray& r, const Interval& ray_t, F&& inside) {
+    static const double STEP = 0.0001;  // Past a crossing before looking for the next one
+
+    // The first crossing is searched without the far limit, a ray that stays inside all of ray_t still has to
+    // leave eventually
+    Hit_Record rec;
+    if (!boundary.hit(r, Interval(ray_t.min, infinity), rec))
+        return false;
+    rec.object->evaluate(r, rec);
+
+    double t = ray_t.min;
+    bool isInside = !rec.front_face;
+    double crossing = rec.t;
+    while (t < ray_t.max) {
+        double end = std::min(crossing, ray_t.max);
+        if (isInside && end > t && inside(t, end))
+            return true;
+        if (crossing >= ray_t.max)
+            return false;
+
+        // Past the last crossing inside ray_t the side flips once more. Otherwise the next crossing's facing
+        // tells, which also resyncs after grazing hits and seams that do not alternate.
+        t = crossing;
+        isInside = !isInside;
+        if (!boundary.hit(r, Interval(t + STEP, ray_t.max), rec)) {
+            crossing = infinity;
+        } else {
+            rec.object->evaluate(r, rec);
+            crossing = rec.t;
+            isInside = !rec.front_face;
+        }
+    }
+    return false;
+}
+
+/*
+    Scalar density on a regular grid of nx * ny * nz voxels spanning bounds, trilinearly interpolated between
+    voxel centres and 0 outside the box. Procedural densities are baked into one with fromFunction(), which
+    makes every lookup a handful of loads and lets the majorants below be exact bounds.
+*/
+class Density_Grid {
+    public:
+        Density_Grid(const AABB& bounds, int nx, int ny, int nz, std::vector<float> values)
+            : m_bounds(bounds), m_res{ nx, ny, nz }, m_values(std::move(values)) {
+            m_values.resize(size_t(nx) * ny * nz, 0.0f);
+        }
+
+        template<typename F>
+        static shared_ptr<Density_Grid> fromFunction(const AABB& bounds, int nx, int ny, int nz, F&& density) {
+            std::vector<float> values(size_t(nx) * ny * nz);
+            vec3 extent = bounds.m_boxMax - bounds.m_boxMin;
+            // One slice per job, density has to be safe to call from several threads
+            globalThreadPool().parallelFor(nz, [&](int z) {
+                for (int y = 0; y < ny; ++y) {
+                    for (int x = 0; x < nx; ++x) {
+                        point3 p = bounds.m_boxMin + vec3((x + 0.5) / nx * extent.x(), (y + 0.5) / ny * extent.y(),
+                                                          (z + 0.5) / nz * extent.z());
+                        values[(size_t(z) * ny + y) * nx + x] = float(std::max(0.0, double(density(p))));
+                    }
+                }
+            });
+            return make_shared<Density_Grid>(bounds, nx, ny, nz, std::move(values));
+        }
+
+        double density(const point3& p) const {
+            vec3 g = toGrid(p);
+            if (g.x() < 0 || g.y() < 0 || g.z() < 0 || g.x() > m_res[0] || g.y() > m_res[1] || g.z() > m_res[2])
+                return 0;
+
+            // Voxel centres sit at half integers
+            double fx = g.x() - 0.5, fy = g.y() - 0.5, fz = g.z() - 0.5;
+            int x0 = int(std::floor(fx)), y0 = int(std::floor(fy)), z0 = int(std::floor(fz));
+            double dx = fx - x0, dy = fy - y0, dz = fz - z0;
+
+            auto at = [&](int x, int y, int z) -> double {
+                x = std::clamp(x, 0, m_res[0] - 1);
+                y = std::clamp(y, 0, m_res[1] - 1);
+                z = std::clamp(z, 0, m_res[2] - 1);
+                return m_values[(size_t(z) * m_res[1] + y) * m_res[0] + x];
+            };
+            auto lerp = [](double t, double a, double b) { return a + t * (b - a); };
+
+            double c00 = lerp(dx, at(x0, y0,     z0),     at(x0 + 1, y0,     z0));
+            double c10 = lerp(dx, at(x0, y0 + 1, z0),     at(x0 + 1, y0 + 1, z0));
+            double c01 = lerp(dx, at(x0, y0,     z0 + 1), at(x0 + 1, y0,     z0 + 1));
+            double c11 = lerp(dx, at(x0, y0 + 1, z0 + 1), at(x0 + 1, y0 + 1, z0 + 1));
+            return lerp(dz, lerp(dy, c00, c10), lerp(dy, c01, c11));
+        }
+
+        // Largest density anywhere in the voxel index ranges [lo, hi] per axis, grown by the one voxel
+        // that interpolation reaches into
+        double maxDensity(const int lo[3], const int hi[3]) const {
+            float result = 0;
+            for (int z = std::max(lo[2] - 1, 0); z <= std::min(hi[2] + 1, m_res[2] - 1); ++z)
+                for (int y = std::max(lo[1] - 1, 0); y <= std::min(hi[1] + 1, m_res[1] - 1); ++y)
+                    for (int x = std::max(lo[0] - 1, 0); x <= std::min(hi[0] + 1, m_res[0] - 1); ++x)
+                        result = std::max(result, m_values[(size_t(z) * m_res[1] + y) * m_res[0] + x]);
+            return result;
+        }
+
+        // Inside the box the grid covers, where density() is the interpolated grid rather than 0
+        bool contains(const point3& p) const {
+            for (int a = 0; a < 3; ++a)
+                if (p[a] < m_bounds.m_boxMin[a] || p[a] > m_bounds.m_boxMax[a])
+                    return false;
+            return true;
+        }
+
+        // Edge length of a voxel along the longest axis
+        double voxelSize() const {
+            vec3 extent = m_bounds.m_boxMax - m_bounds.m_boxMin;
+            return std::max({ extent.x() / m_res[0], extent.y() / m_res[1], extent.z() / m_res[2] });
+        }
+
+        const AABB& bounds() const {
+            return m_bounds;
+        }
+
+        int resolution(int axis) const {
+            return m_res[axis];
+        }
+
+    private:
+        vec3 toGrid(const point3& p) const {
+            vec3 extent = m_bounds.m_boxMax - m_bounds.m_boxMin;
+            vec3 d = p - m_bounds.m_boxMin;
+            return vec3(d.x() / extent.x() * m_res[0], d.y() / extent.y() * m_res[1], d.z() / extent.z() * m_res[2]);
+        }
+
+        AABB m_bounds;
+        int m_res[3];
+        std::vector<float> m_values;
+};
+
+// Perlin turbulence baked into a grid, frequency is in noise periods per unit of world space
+inline shared_ptr<Density_Grid> perlinDensity(const AABB& bounds, int resolution, double frequency, uint64_t seed = 0) {
+    Perlin noise(seed);
+    return Density_Grid::fromFunction(bounds, resolution, resolution, resolution, [&](const point3& p) {
+        return noise.turb(frequency * p, 7);
+    });
+}
+
+/*
+    Coarse grid of density upper bounds over a Density_Grid. Delta and ratio tracking take exponential steps
+    against the bound of the cell they are in, so thin cells are crossed in few steps and empty cells in none.
+*/
+class Majorant_Grid {
+    public:
+        Majorant_Grid(const Density_Grid& density, int resolution = 16) : m_bounds(density.bounds()) {
+            for (int a = 0; a < 3; ++a)
+                m_res[a] = std::max(1, std::min(resolution, density.resolution(a)));
+
+            m_max.resize(size_t(m_res[0]) * m_res[1] * m_res[2]);
+            for (int z = 0; z < m_res[2]; ++z) {
+                for (int y = 0; y < m_res[1]; ++y) {
+                    for (int x = 0; x < m_res[0]; ++x) {
+                        int cell[3] = { x, y, z }, lo[3], hi[3];
+                        for (int a = 0; a < 3; ++a) {
+                            int n = density.resolution(a);
+                            lo[a] = cell[a] * n / m_res[a];
+                            hi[a] = ((cell[a] + 1) * n + m_res[a] - 1) / m_res[a] - 1;
+                        }
+                        m_max[(size_t(z) * m_res[1] + y) * m_res[0] + x] = density.maxDensity(lo, hi);
+                    }
+                }
+            }
+        }
+
+        /*
+            3D DDA: calls cell(t0, t1, majorant) for each cell r crosses between tMin and tMax, in order, and
+            stops when it returns true. Returns whether it was stopped.
+        */
+        template<typename F>
+        bool traverse(const Ray& r, double tMin, double tMax, F&& cell) const {
+            // Grid space, where cells are unit cubes. t keeps its meaning since the map is affine.
+            vec3 extent = m_bounds.m_boxMax - m_bounds.m_boxMin;
+            point3 o, d;
+            for (int a = 0; a < 3; ++a) {
+                o[a] = (r.origin()[a] - m_bounds.m_boxMin[a]) / extent[a] * m_res[a];
+                d[a] = r.direction()[a] / extent[a] * m_res[a];
+            }
+
+            // Clip to the grid
+            for (int a = 0; a < 3; ++a) {
+                if (d[a] == 0) {
+                    if (o[a] < 0 || o[a] > m_res[a])
+                        return false;
+                    continue;
+                }
+                double t0 = -o[a] / d[a], t1 = (m_res[a] - o[a]) / d[a];
+                if (t0 > t1)
+                    std::swap(t0, t1);
+                tMin = std::max(tMin, t0);
+                tMax = std::min(tMax, t1);
+            }
+            if (tMin >= tMax)
+                return false;
+
+            int voxel[3], step[3], limit[3];
+            double next[3], delta[3];
+            for (int a = 0; a < 3; ++a) {
+                double p = o[a] + d[a] * tMin;
+                voxel[a] = std::clamp(int(std::floor(p)), 0, m_res[a] - 1);
+                if (d[a] > 0) {
+                    step[a] = 1;
+                    limit[a] = m_res[a];
+                    next[a] = tMin + (voxel[a] + 1 - p) / d[a];
+                    delta[a] = 1 / d[a];
+                } else if (d[a] < 0) {
+                    step[a] = -1;
+                    limit[a] = -1;
+                    next[a] = tMin + (voxel[a] - p) / d[a];
+                    delta[a] = -1 / d[a];
+                } else {
+                    step[a] = 0;
+                    limit[a] = -1;
+                    next[a] = infinity;
+                    delta[a] = infinity;
+                }
+            }
+
+            double t = tMin;
+            while (t < tMax) {
+                int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+                double tExit = std::min(next[axis], tMax);
+                double majorant = m_max[(size_t(voxel[2]) * m_res[1] + voxel[1]) * m_res[0] + voxel[0]];
+                if (cell(t, tExit, majorant))
+                    return true;
+
+                t = tExit;
+                voxel[axis] += step[axis];
+                if (voxel[axis] == limit[axis])
+                    break;
+                next[axis] += delta[axis];
+            }
+            return false;
+        }
+
+    private:
+        AABB m_bounds;
+        int m_res[3];
+        std::vector<float> m_max;
+};
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "utilities.h"
+#include "hittable_list.h"
+#include "bvh_builder.h"
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/*
+    N-wide node. Child bounds are kept as structure of arrays (all the child min x's together, etc) so one
+    vector slab test checks every child at once. Unused slots get inverted bounds and can never be hit.
+    A child with count > 0 is a leaf covering primitives [child, child + count), otherwise child is the index
+    of another wide node.
+*/
+template<int N>
+struct alignas(32) WideBVHNode {
+    float minX[N], minY[N], minZ[N];
+    float maxX[N], maxY[N], maxZ[N];
+    uint32_t child[N];
+    uint16_t count[N];
+};
+
+/*
+    Nodes of a BVH with 4 or 8 children per node, made by collapsing the binary SAH tree: each wide node starts
+    from a binary node's two children and keeps opening the interior child with the largest surface area until
+    it has N of them. That halves (BVH4) or thirds (BVH8) the depth of the tree. Leaves keep the binary tree's
+    primitive ranges, so whoever owns the primitives in that order can walk it: WideBVH below, or a
+    CompiledScene built with a wide BVHLayout.
+
+    Node tests run in single precision on SSE (BVH4) or AVX (BVH8) when the compiler targets them, and fall
+    back to a plain per-lane loop otherwise.
+*/
+template<int N>
+class WideBVHTree {
+    public:
+        WideBVHTree() {}
+
+        explicit WideBVHTree(const std::vector<LinearBVHNode>& binary) {
+            if (!binary.empty())
+                collapse(binary, 0);
+        }
+
+        bool empty() const {
+            return m_nodes.empty();
+        }
+
+        /*
+            Calls leaf(first, count) for the primitive ranges r reaches between tMin and tMax, nearest child
+            first. leaf lowers tMax when it finds a closer hit, and whatever lies behind it is skipped.
+        */
+        template<typename F>
+        void traverseNearest(const Ray& r, double tMin, double& tMax, F&& leaf) const {
+            if (m_nodes.empty())
+                return;
+
+            RayLanes lanes(r);
+            StackEntry stack[STACK_SIZE];
+            int stackSize = 0;
+            stack[stackSize++] = StackEntry{ 0, 0, -infinity };
+
+            while (stackSize > 0) {
+                StackEntry entry = stack[--stackSize];
+                if (entry.tNear > tMax * FAR_SCALE)
+                    continue;
+
+                if (entry.count > 0) {
+                    leaf(entry.child, entry.count);
+                    continue;
+                }
+
+                const WideBVHNode<N>& node = m_nodes[entry.child];
+                float tNear[N];
+                int mask = intersectChildren(node, lanes, tMin, tMax, tNear);
+
+                // Push the hit children far to near so the nearest one is popped first
+                int first = stackSize;
+                for (int c = 0; c < N; ++c) {
+                    if (!(mask & (1 << c)))
+                        continue;
+                    StackEntry child{ node.child[c], node.count[c], tNear[c] };
+                    int pos = stackSize++;
+                    while (pos > first && stack[pos - 1].tNear < child.tNear) {
+                        stack[pos] = stack[pos - 1];
+                        --pos;
+                    }
+                    stack[pos] = child;
+                }
+            }
+        }
+
+        // Calls leaf(first, count) for every primitive range r reaches between tMin and tMax, in no particular
+        // order, until it returns true. Returns whether it did.
+        template<typename F>
+        bool traverseAny(const Ray& r, double tMin, double tMax, F&& leaf) const {
+            if (m_nodes.empty())
+                return false;
+
+            RayLanes lanes(r);
+            StackEntry stack[STACK_SIZE];
+            int stackSize = 0;
+            stack[stackSize++] = StackEntry{ 0, 0, -infinity };
+
+            while (stackSize > 0) {
+                StackEntry entry = stack[--stackSize];
+                if (entry.count > 0) {
+                    if (leaf(entry.child, entry.count))
+                        return true;
+                    continue;
+                }
+
+                const WideBVHNode<N>& node = m_nodes[entry.child];
+                float tNear[N];
+                int mask = intersectChildren(node, lanes, tMin, tMax, tNear);
+                for (int c = 0; c < N; ++c) {
+                    if (mask & (1 << c))
+                        stack[stackSize++] = StackEntry{ node.child[c], node.count[c], tNear[c] };
+                }
+            }
+            return false;
+        }
+
+    private:
+        static const int STACK_SIZE = BVH_MAX_DEPTH * (N - 1) + 1;
+
+        struct StackEntry {
+            uint32_t child;
+            uint32_t count;
+            double tNear;
+        };
+
+        // Ray data converted to float once per traversal. dirIsNeg picks which of a node's min/max planes the
+        // ray enters through on each axis, so the slab test needs no swaps. Rounding the origin to float moves
+        // it by up to half an ulp, so the near and far tests each use an origin nudged the conservative way.
+        struct RayLanes {
+            float origNear[3];
+            float origFar[3];
+            float invDir[3];
+            bool dirIsNeg[3];
+
+            RayLanes(const Ray& r) {
+                for (int a = 0; a < 3; ++a) {
+                    double o = r.origin()[a];
+                    float err = float(std::fabs(o)) * 1.1920929e-07f;
+                    invDir[a] = float(r.inv_direction()[a]);
+                    dirIsNeg[a] = r.inv_direction()[a] < 0;
+                    origNear[a] = float(o) + (dirIsNeg[a] ? -err : err);
+                    origFar[a]  = float(o) + (dirIsNeg[a] ? err : -err);
+                }
+            }
+        };
+
+        // Widens the far distance to cover float rounding in the slab test (pbrt's 1 + 2 * gamma(3))
+        static constexpr float FAR_SCALE = 1.0f + 2.0f * (3 * 5.96046448e-08f) / (1 - 3 * 5.96046448e-08f);
+
+        static int intersectChildren(const WideBVHNode<N>& node, const RayLanes& ray, double tmin, double tmax, float* tNearOut) {
+            const float* nearX = ray.dirIsNeg[0] ? node.maxX : node.minX;
+            const float* farX  = ray.dirIsNeg[0] ? node.minX : node.maxX;
+            const float* nearY = ray.dirIsNeg[1] ? node.maxY : node.minY;
+            const float* farY  = ray.dirIsNeg[1] ? node.minY : node.maxY;
+            const float* nearZ = ray.dirIsNeg[2] ? node.maxZ : node.minZ;
+            const float* farZ  = ray.dirIsNeg[2] ? node.minZ : node.maxZ;
+            float ftmin = LinearBVHNode::roundDown(tmin);
+            float ftmax = LinearBVHNode::roundUp(tmax);
+
+#if defined(__AVX__)
+            if constexpr (N == 8) {
+                __m256 nx = _mm256_set1_ps(ray.origNear[0]), ny = _mm256_set1_ps(ray.origNear[1]), nz = _mm256_set1_ps(ray.origNear[2]);
+                __m256 fx = _mm256_set1_ps(ray.origFar[0]), fy = _mm256_set1_ps(ray.origFar[1]), fz = _mm256_set1_ps(ray.origFar[2]);
+                __m256 ix = _mm256_set1_ps(ray.invDir[0]), iy = _mm256_set1_ps(ray.invDir[1]), iz = _mm256_set1_ps(ray.invDir[2]);
+                // max/min return their second operand when the first is NaN, which keeps NaN slabs harmless
+                __m256 tNear = _mm256_set1_ps(ftmin);
+                __m256 tFar  = _mm256_set1_ps(ftmax);
+                tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearX), nx), ix), tNear);
+                tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearY), ny), iy), tNear);
+                tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearZ), nz), iz), tNear);
+                tFar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farX), fx), ix), tFar);
+                tFar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farY), fy), iy), tFar);
+                tFar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farZ), fz), iz), tFar);
+                tFar = _mm256_mul_ps(tFar, _mm256_set1_ps(FAR_SCALE));
+                _mm256_storeu_ps(tNearOut, tNear);
+                return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+            }
+#endif
+#if defined(__SSE2__)
+            if constexpr (N == 4) {
+                __m128 nx = _mm_set1_ps(ray.origNear[0]), ny = _mm_set1_ps(ray.origNear[1]), nz = _mm_set1_ps(ray.origNear[2]);
+                __m128 fx = _mm_set1_ps(ray.origFar[0]), fy = _mm_set1_ps(ray.origFar[1]), fz = _mm_set1_ps(ray.origFar[2]);
+                __m128 ix = _mm_set1_ps(ray.invDir[0]), iy = _mm_set1_ps(ray.invDir[1]), iz = _mm_set1_ps(ray.invDir[2]);
+                // max/min return their second operand when the first is NaN, which keeps NaN slabs harmless
+                __m128 tNear = _mm_set1_ps(ftmin);
+                __m128 tFar  = _mm_set1_ps(ftmax);
+                tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX), nx), ix), tNear);
+                tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY), ny), iy), tNear);
+                tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ), nz), iz), tNear);
+                tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX), fx), ix), tFar);
+                tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY), fy), iy), tFar);
+                tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ), fz), iz), tFar);
+                tFar = _mm_mul_ps(tFar, _mm_set1_ps(FAR_SCALE));
+                _mm_storeu_ps(tNearOut, tNear);
+                return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+            }
+#endif
+            int mask = 0;
+            for (int c = 0; c < N; ++c) {
+                float tNear = ftmin, tFar = ftmax;
+                float t;
+                t = (nearX[c] - ray.origNear[0]) * ray.invDir[0]; tNear = t > tNear ? t : tNear;
+                t = (nearY[c] - ray.origNear[1]) * ray.invDir[1]; tNear = t > tNear ? t : tNear;
+                t = (nearZ[c] - ray.origNear[2]) * ray.invDir[2]; tNear = t > tNear ? t : tNear;
+                t = (farX[c] - ray.origFar[0]) * ray.invDir[0]; tFar = t < tFar ? t : tFar;
+                t = (farY[c] - ray.origFar[1]) * ray.invDir[1]; tFar = t < tFar ? t : tFar;
+                t = (farZ[c] - ray.origFar[2]) * ray.invDir[2]; tFar = t < tFar ? t : tFar;
+                tNearOut[c] = tNear;
+                if (tNear <= tFar * FAR_SCALE)
+                    mask |= 1 << c;
+            }
+            return mask;
+        }
+
+        uint32_t collapse(const std::vector<LinearBVHNode>& binary, uint32_t binIdx) {
+            uint32_t idx = uint32_t(m_nodes.size());
+            m_nodes.emplace_back();
+
+            uint32_t slots[N];
+            int slotCount = 0;
+            if (binary[binIdx].isLeaf()) {
+                slots[slotCount++] = binIdx;
+            } else {
+                slots[slotCount++] = binIdx + 1;
+                slots[slotCount++] = binary[binIdx].secondChildOffset;
+            }
+
+            // Open up the biggest interior child until every slot is used
+            while (slotCount < N) {
+                int best = -1;
+                double bestArea = -1;
+                for (int s = 0; s < slotCount; ++s) {
+                    const LinearBVHNode& candidate = binary[slots[s]];
+                    if (candidate.isLeaf())
+                        continue;
+                    double area = candidate.bounds().surfaceArea();
+                    if (area > bestArea) {
+                        bestArea = area;
+                        best = s;
+                    }
+                }
+                if (best < 0)
+                    break;
+
+                uint32_t opened = slots[best];
+                slots[best] = opened + 1;
+                slots[slotCount++] = binary[opened].secondChildOffset;
+            }
+
+            uint32_t children[N];
+            uint16_t counts[N];
+            for (int s = 0; s < slotCount; ++s) {
+                const LinearBVHNode& b = binary[slots[s]];
+                counts[s] = b.primitiveCount;
+                children[s] = b.isLeaf() ? b.primitivesOffset : collapse(binary, slots[s]);
+            }
+
+            // m_nodes may have reallocated while collapsing the children
+            WideBVHNode<N>& node = m_nodes[idx];
+            for (int c = 0; c < N; ++c) {
+                if (c < slotCount) {
+                    const LinearBVHNode& b = binary[slots[c]];
+                    node.minX[c] = b.boundsMin[0]; node.minY[c] = b.boundsMin[1]; node.minZ[c] = b.boundsMin[2];
+                    node.maxX[c] = b.boundsMax[0]; node.maxY[c] = b.boundsMax[1]; node.maxZ[c] = b.boundsMax[2];
+                    node.child[c] = children[c];
+                    node.count[c] = counts[c];
+                } else {
+                    float inf = std::numeric_limits<float>::infinity();
+                    node.minX[c] = node.minY[c] = node.minZ[c] = inf;
+                    node.maxX[c] = node.maxY[c] = node.maxZ[c] = -inf;
+                    node.child[c] = 0;
+                    node.count[c] = 0;
+                }
+            }
+            return idx;
+        }
+
+        std::vector<WideBVHNode<N>> m_nodes;
+};
+
+/*
+    Hittable over a WideBVHTree, a drop in for BVH_Node. Children are visited nearest first.
+*/
+template<int N>
+class WideBVH : public Hittable {
+    public:
+        WideBVH(Hittable_List hitlist, int max_leaf_size = 4, BVHBuildMethod method = BVHBuildMethod::SAH) {
+            auto& objects = hitlist.objects;
+            std::vector<AABB> primBounds(objects.size());
+            m_aabb = AABB::empty;
+            for (size_t idx = 0; idx < objects.size(); ++idx) {
+                primBounds[idx] = objects[idx]->getBoundingBox();
+                m_aabb = AABB(m_aabb, primBounds[idx]);
+            }
+
+            std::vector<LinearBVHNode> binary;
+            std::vector<uint32_t> primOrder;
+            buildBVH(method, max_leaf_size, primBounds, binary, primOrder);
+
+            m_primitives.reserve(primOrder.size());
+            for (uint32_t idx : primOrder)
+                m_primitives.push_back(objects[idx]);
+
+            m_tree = WideBVHTree<N>(binary);
+        }
+
+        bool hit(const Ray& r, const Interval& ray_t, Hit_Record& rec) const override {
+            bool hit_anything = false;
+            double closest_so_far = ray_t.max;
+            m_tree.traverseNearest(r, ray_t.min, closest_so_far, [&](uint32_t first, uint32_t count) {
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (m_primitives[i]->hit(r, Interval(ray_t.min, closest_so_far), rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+            });
+            return hit_anything;
+        }
+
+        bool occluded(const Ray& r, const Interval& ray_t) const override {
+            return m_tree.traverseAny(r, ray_t.min, ray_t.max, [&](uint32_t first, uint32_t count) {
+                for (uint32_t i = first; i < first + count; ++i)
+                    if (m_primitives[i]->occluded(r, ray_t))
+                        return true;
+                return false;
+            });
+        }
+
+        double transmittance(const Ray& r, const Interval& ray_t) const override {
+            double T = 1;
+            m_tree.traverseAny(r, ray_t.min, ray_t.max, [&](uint32_t first, uint32_t count) {
+                for (uint32_t i = first; i < first + count; ++i) {
+                    T *= m_primitives[i]->transmittance(r, ray_t);
+                    if (T <= 0)
+                        return true;
+                }
+                return false;
+            });
+            return T <= 0 ? 0 : T;
+        }
+
+        AABB getBoundingBox() const override {
+            return m_aabb;
+        }
+
+        void gatherLights(std::vector<const Hittable*>& lights) const override {
+            for (const auto& prim : m_primitives)
+                prim->gatherLights(lights);
+        }
+
+        // In leaf order, so scene compilation can flatten the tree without another build
+        const std::vector<shared_ptr<Hittable>>& primitives() const {
+            return m_primitives;
+        }
+
+    private:
+        WideBVHTree<N> m_tree;
+        std::vector<shared_ptr<Hittable>> m_primitives;  // Leaf order, shared with the binary build
+        AABB m_aabb;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+#endif